@@ -0,0 +1,74 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+
+/* OTAsync tests
+ */
+
+#include "../../Source/openTIDAL.h"
+#include <stdio.h>
+
+static void
+callback (void *container, enum OTTypes type, enum OTStatus status, void *userData)
+{
+    struct OTContentContainer *content = (struct OTContentContainer *)container;
+    if (content && status == SUCCESS)
+        printf ("Offset %ld Title: %s\n", (long)userData,
+                OTJsonGetObjectItemStringValue (content->tree, "title"));
+    OTDeallocContainer (container, type);
+}
+
+int
+main (void)
+{
+    struct OTSessionContainer *session = NULL;
+    void *async = NULL;
+    long i;
+
+    /* Create a new libopenTIDAL session. */
+    session = OTSessionInit ();
+    if (!session)
+        return -1;
+
+    /* Specify the clientId and clientSecret. */
+    if (!(OTSessionClientPair (session, "CLIENTID", "CLIENTSECRET") == 0))
+        return -1;
+
+    async = OTAsyncInit ();
+    if (!async)
+        return -1;
+
+    /* Submit all requests without blocking. */
+    for (i = 0; i < 10; i++)
+        {
+            void *request = OTAsyncRequestCreate (async, callback, (void *)i);
+            OTServiceGetStandard (session, "albums", NULL, "13479529", 1, i, request);
+        }
+
+    /* Drive all transfers from this thread. */
+    while (OTAsyncPerform (async, 1000) > 0)
+        ;
+
+    OTAsyncCleanup (async);
+    OTSessionCleanup (session);
+    return 0;
+}
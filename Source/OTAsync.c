@@ -0,0 +1,557 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* openTIDAL asynchronous request engine (libcurl multi interface)
+ */
+
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "OTHttp.h"
+#include "OTJson.h"
+#include "openTIDAL.h"
+
+/* Interval in milliseconds at which a request waiting for a renewed token checks for it. */
+#define OTASYNC_TOKEN_POLL 50
+
+enum OTAsyncRequestState
+{
+    ASYNC_IDLE,
+    ASYNC_RESERVED,
+    ASYNC_RUNNING,
+    ASYNC_WAITING,
+    ASYNC_DONE
+};
+
+/* One request handle. The embedded http-handle is passed to a service function as
+ * threadHandle. Request handles are recycled after their result has been delivered. */
+struct OTAsyncRequest
+{
+    struct OTHttpHandle *handle;
+    struct OTAsyncContainer *async;
+    struct OTSessionContainer *session;
+    struct OTHttpContainer http;
+    enum OTHttpTypes type;
+    enum OTAsyncRequestState state;
+    OTAsyncFinishFunction finish;
+    OTAsyncStoreFunction store;
+    OTAsyncCallback callback;
+    void *userData;
+    /* Result of the finished request. */
+    void *container;
+    enum OTTypes containerType;
+    enum OTStatus status;
+    /* Time of the next attempt if the request is waiting for a retry or the rate limit. */
+    long long retryAt;
+    /* Non-zero if the request waits for the background refresher to renew its token. */
+    int isTokenWaiting;
+    /* Every request is in the list of all requests and optionally in a queue. */
+    struct OTAsyncRequest *nextAll;
+    struct OTAsyncRequest *next;
+};
+
+struct OTAsyncQueue
+{
+    struct OTAsyncRequest *head;
+    struct OTAsyncRequest *tail;
+};
+
+struct OTAsyncContainer
+{
+    CURLM *multi;
+    struct OTAsyncRequest *requests;
+    /* Recycled request handles. */
+    struct OTAsyncQueue idle;
+    /* Finished requests waiting for their callback. */
+    struct OTAsyncQueue callbacks;
+    /* Finished requests without callback waiting for OTAsyncRead. */
+    struct OTAsyncQueue results;
+    /* Requests waiting for a retry or the rate limit. Not ordered by time. */
+    struct OTAsyncQueue waiting;
+    int running;
+    /* Multiplexing options currently applied to the multi handle. */
+    int multiplexStreams;
+};
+
+static void
+OTAsyncQueuePush (struct OTAsyncQueue *const queue, struct OTAsyncRequest *const request)
+{
+    request->next = NULL;
+    if (queue->tail)
+        queue->tail->next = request;
+    else
+        queue->head = request;
+    queue->tail = request;
+}
+
+static struct OTAsyncRequest *
+OTAsyncQueuePop (struct OTAsyncQueue *const queue)
+{
+    struct OTAsyncRequest *request = queue->head;
+    if (request)
+        {
+            queue->head = request->next;
+            if (!queue->head) queue->tail = NULL;
+            request->next = NULL;
+        }
+    return request;
+}
+
+/* Allocate an asynchronous request engine. */
+void *
+OTAsyncInit (void)
+{
+    struct OTAsyncContainer *async = NULL;
+    async = malloc (sizeof (struct OTAsyncContainer));
+    if (!async) return NULL;
+    async->multi = curl_multi_init ();
+    if (!async->multi)
+        {
+            free (async);
+            return NULL;
+        }
+    async->requests = NULL;
+    async->idle.head = async->idle.tail = NULL;
+    async->callbacks.head = async->callbacks.tail = NULL;
+    async->results.head = async->results.tail = NULL;
+    async->waiting.head = async->waiting.tail = NULL;
+    async->running = 0;
+    async->multiplexStreams = 0;
+    return async;
+}
+
+/* Reserve a request handle. Pass it as threadHandle to exactly one service function. */
+void *
+OTAsyncRequestCreate (void *async, OTAsyncCallback callback, void *userData)
+{
+    struct OTAsyncContainer *ptr = (struct OTAsyncContainer *)async;
+    struct OTAsyncRequest *request = NULL;
+    if (!ptr) return NULL;
+
+    request = OTAsyncQueuePop (&ptr->idle);
+    if (!request)
+        {
+            request = malloc (sizeof (struct OTAsyncRequest));
+            if (!request) return NULL;
+            request->handle = OTHttpThreadHandleCreate ();
+            if (!request->handle)
+                {
+                    free (request);
+                    return NULL;
+                }
+            request->handle->asyncRequest = request;
+            /* Completed transfers are matched to their request (See OTAsyncPerform). */
+            curl_easy_setopt (request->handle->curl, CURLOPT_PRIVATE, request);
+            request->async = ptr;
+            request->nextAll = ptr->requests;
+            ptr->requests = request;
+        }
+    request->state = ASYNC_RESERVED;
+    request->session = NULL;
+    request->finish = NULL;
+    request->store = NULL;
+    request->callback = callback;
+    request->userData = userData;
+    request->container = NULL;
+    request->status = UNKNOWN;
+    request->isTokenWaiting = 0;
+    request->next = NULL;
+    return request->handle;
+}
+
+/* Queue the result of a finished request for its delivery. */
+static void
+OTAsyncDeliver (struct OTAsyncRequest *const request)
+{
+    struct OTAsyncContainer *async = request->async;
+    request->state = ASYNC_DONE;
+    if (request->callback)
+        OTAsyncQueuePush (&async->callbacks, request);
+    else
+        OTAsyncQueuePush (&async->results, request);
+}
+
+/* Free the copies of the request keys. */
+static void
+OTAsyncKeysFree (struct OTAsyncRequest *const request)
+{
+    free (request->http.endpoint);
+    free (request->http.parameter);
+    request->http.endpoint = NULL;
+    request->http.parameter = NULL;
+}
+
+/* Run the store and finish functions of a completed transfer and queue the result. */
+static void
+OTAsyncComplete (struct OTAsyncRequest *const request, CURLcode res)
+{
+    request->http.httpOk = -1;
+    OTHttpFinish (request->session, &request->http, res);
+    if (request->store) request->store (request->session, &request->http);
+    request->status = UNKNOWN;
+    request->container = request->finish (&request->http, &request->status);
+    OTAsyncKeysFree (request);
+    OTAsyncDeliver (request);
+}
+
+/* Apply the HTTP/2 multiplexing options of the session to the multi handle. With
+ * multiplexing only one connection per host is opened, transfers exceeding the stream
+ * limit are queued by libcurl until a stream is available. */
+static void
+OTAsyncMultiplex (struct OTAsyncContainer *const async,
+                  const struct OTSessionContainer *const session)
+{
+    if (async->multiplexStreams == session->multiplexStreams) return;
+    if (session->multiplexStreams)
+        {
+            curl_multi_setopt (async->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+            curl_multi_setopt (async->multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                               (long)session->multiplexStreams);
+            curl_multi_setopt (async->multi, CURLMOPT_MAX_HOST_CONNECTIONS, 1L);
+        }
+    else
+        {
+            /* libcurl defaults. */
+            curl_multi_setopt (async->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, 100L);
+            curl_multi_setopt (async->multi, CURLMOPT_MAX_HOST_CONNECTIONS, 0L);
+        }
+    async->multiplexStreams = session->multiplexStreams;
+}
+
+/* Called by the service request functions if the http-handle is an asynchronous request
+ * handle and the request was answered from a cache. The finish function runs immediately,
+ * the result is delivered by the next OTAsyncPerform. */
+void
+OTAsyncResolve (struct OTSessionContainer *const session, struct OTHttpContainer *const http,
+                enum OTTypes type, OTAsyncFinishFunction finish)
+{
+    struct OTAsyncRequest *request = http->handle->asyncRequest;
+    if (request->state != ASYNC_RESERVED)
+        {
+            if (session->verboseMode)
+                fprintf (stderr, "* Asynchronous request handle is already in use.\n");
+            return;
+        }
+    request->session = session;
+    request->containerType = type;
+    request->status = UNKNOWN;
+    request->container = finish (http, &request->status);
+    OTAsyncDeliver (request);
+}
+
+/* Called by the service request functions if the http-handle is an asynchronous request
+ * handle. The request is configured immediately, so the caller may free the values of the
+ * OTHttpContainer after this call. The stale tree and entity-tag of a cache lookup are
+ * taken over by the request. Failed submissions complete with CURL_NOT_OK or, if the
+ * circuit breaker is open, with SERVICE_UNAVAILABLE. */
+int
+OTAsyncSubmit (struct OTSessionContainer *const session, struct OTHttpContainer *const http,
+               enum OTTypes type, OTAsyncFinishFunction finish, OTAsyncStoreFunction store)
+{
+    struct OTAsyncRequest *request = http->handle->asyncRequest;
+    CURLcode res;
+    long delay;
+    if (request->state != ASYNC_RESERVED)
+        {
+            if (session->verboseMode)
+                fprintf (stderr, "* Asynchronous request handle is already in use.\n");
+            return -1;
+        }
+
+    request->session = session;
+    request->finish = finish;
+    request->store = store;
+    request->containerType = type;
+    request->type = *http->type;
+    request->http = *http;
+    request->http.type = &request->type;
+    /* The values are owned by the caller. The store function keys the caches by copies of
+     * the endpoint and the parameters. */
+    request->http.endpoint = NULL;
+    request->http.parameter = NULL;
+    request->http.postData = NULL;
+    request->http.entityTagHeader = NULL;
+    request->http.response = NULL;
+    if (store && http->endpoint)
+        {
+            request->http.endpoint = strdup (http->endpoint);
+            if (http->parameter) request->http.parameter = strdup (http->parameter);
+            if (!request->http.endpoint || (http->parameter && !request->http.parameter))
+                {
+                    OTAsyncKeysFree (request);
+                    request->store = NULL;
+                }
+        }
+
+    if (OTHttpPrepare (session, http) != 0)
+        {
+            request->http.isRejected = http->isRejected;
+            request->http.isCancelled = http->isCancelled;
+            request->http.isDeadlineExceeded = http->isDeadlineExceeded;
+            OTAsyncComplete (request, CURLE_FAILED_INIT);
+            return -1;
+        }
+    /* The post data is freed by the caller before the transfer is performed. */
+    if (http->postData && request->type != GET && request->type != HEAD)
+        curl_easy_setopt (request->handle->curl, CURLOPT_COPYPOSTFIELDS, http->postData);
+
+    OTAsyncMultiplex (request->async, session);
+    /* A request with an expired token waits for the renewal by the background refresher. */
+    if (session->refreshToken && request->handle->token
+        && OTHttpTokenIsExpired (request->handle->token))
+        request->isTokenWaiting = 1;
+    /* A request exceeding the rate limit waits without blocking the caller. */
+    delay = OTHttpLimitAcquire (session, http, request->isTokenWaiting ? OTASYNC_TOKEN_POLL : 0);
+    res = OTHttpBudget (request->handle, delay);
+    if (res != CURLE_OK)
+        {
+            OTAsyncComplete (request, res);
+            return -1;
+        }
+    if (delay > 0)
+        {
+            request->state = ASYNC_WAITING;
+            request->retryAt = OTHttpTime () + delay;
+            OTAsyncQueuePush (&request->async->waiting, request);
+            request->async->running += 1;
+            return 0;
+        }
+    if (curl_multi_add_handle (request->async->multi, request->handle->curl) != CURLM_OK)
+        {
+            OTAsyncComplete (request, CURLE_FAILED_INIT);
+            return -1;
+        }
+    request->state = ASYNC_RUNNING;
+    request->async->running += 1;
+    return 0;
+}
+
+/* Recycle a request handle after its result has been delivered. The settings of the
+ * previous caller are removed, its cancellation token may already be freed. */
+static void
+OTAsyncRecycle (struct OTAsyncRequest *const request)
+{
+    request->state = ASYNC_IDLE;
+    request->container = NULL;
+    request->callback = NULL;
+    request->userData = NULL;
+    OTHttpThreadHandleCancel (request->handle, NULL);
+    OTHttpThreadHandleDeadline (request->handle, 0);
+    OTHttpThreadHandleHeaders (request->handle, 0);
+    OTAsyncQueuePush (&request->async->idle, request);
+}
+
+/* Release a reserved request handle that the service function did not submit because it
+ * does not support asynchronous requests. No result is delivered. */
+void
+OTAsyncRelease (struct OTHttpHandle *const handle)
+{
+    struct OTAsyncRequest *request = handle->asyncRequest;
+    if (request->state == ASYNC_RESERVED) OTAsyncRecycle (request);
+}
+
+/* Add the waiting requests whose retry is due back to the multi handle. Waiting requests
+ * that are cancelled or cannot start before their deadline complete at once. A request
+ * waiting for a renewed token is switched to it once it is published. Past its retry
+ * deadline it is sent with the previous token, which the server answers with 401.
+ * Returns the time in milliseconds until the next retry is due or timeoutMs if it is
+ * later. */
+static int
+OTAsyncResume (struct OTAsyncContainer *const async, const int timeoutMs)
+{
+    struct OTAsyncQueue waiting = async->waiting;
+    struct OTAsyncRequest *request = NULL;
+    long long now = OTHttpTime ();
+    int timeout = timeoutMs;
+    int renewed;
+    CURLcode res;
+
+    async->waiting.head = async->waiting.tail = NULL;
+    while ((request = OTAsyncQueuePop (&waiting)))
+        {
+            res = OTHttpBudget (request->handle, (long)(request->retryAt - now));
+            if (res != CURLE_OK)
+                {
+                    async->running -= 1;
+                    OTAsyncComplete (request, res);
+                }
+            else if (request->retryAt <= now && request->isTokenWaiting
+                     && (renewed = OTHttpReauthorised (request->session, &request->http)) != 1)
+                {
+                    request->isTokenWaiting = 0;
+                    if (renewed < 0)
+                        {
+                            async->running -= 1;
+                            OTAsyncComplete (request, CURLE_OUT_OF_MEMORY);
+                        }
+                    else
+                        OTAsyncQueuePush (&waiting, request);
+                }
+            else if (request->retryAt <= now && request->isTokenWaiting
+                     && now < request->handle->deadline)
+                {
+                    request->retryAt = now + OTASYNC_TOKEN_POLL;
+                    if (OTASYNC_TOKEN_POLL < timeout) timeout = OTASYNC_TOKEN_POLL;
+                    OTAsyncQueuePush (&async->waiting, request);
+                }
+            else if (request->retryAt > now)
+                {
+                    if (request->retryAt - now < timeout) timeout = (int)(request->retryAt - now);
+                    OTAsyncQueuePush (&async->waiting, request);
+                }
+            else if (curl_multi_add_handle (async->multi, request->handle->curl) == CURLM_OK)
+                {
+                    request->isTokenWaiting = 0;
+                    request->state = ASYNC_RUNNING;
+                }
+            else
+                {
+                    async->running -= 1;
+                    OTAsyncComplete (request, CURLE_FAILED_INIT);
+                }
+        }
+    return timeout;
+}
+
+/* Drive all transfers. Waits at most timeoutMs milliseconds for network activity and
+ * delivers the callbacks of finished requests. Failed transfers are repeated according
+ * to the retry policy of the session without blocking the other requests.
+ * Returns the number of requests in flight or -1 if an error occurred. */
+int
+OTAsyncPerform (void *async, const int timeoutMs)
+{
+    struct OTAsyncContainer *ptr = (struct OTAsyncContainer *)async;
+    struct OTAsyncRequest *request = NULL;
+    CURLMsg *msg = NULL;
+    int stillRunning = 0;
+    int queued = 0;
+    int timeout;
+    long delay;
+
+    if (!ptr) return -1;
+    if (ptr->running)
+        {
+            timeout = OTAsyncResume (ptr, timeoutMs);
+            if (curl_multi_perform (ptr->multi, &stillRunning) != CURLM_OK) return -1;
+            if (stillRunning || ptr->waiting.head)
+                {
+                    if (curl_multi_poll (ptr->multi, NULL, 0, timeout, NULL) != CURLM_OK)
+                        return -1;
+                    OTAsyncResume (ptr, timeoutMs);
+                    if (curl_multi_perform (ptr->multi, &stillRunning) != CURLM_OK) return -1;
+                }
+            while ((msg = curl_multi_info_read (ptr->multi, &queued)))
+                {
+                    if (msg->msg != CURLMSG_DONE) continue;
+                    CURL *curl = msg->easy_handle;
+                    CURLcode res = msg->data.result;
+                    char *privateData = NULL;
+                    curl_multi_remove_handle (ptr->multi, curl);
+                    if (curl_easy_getinfo (curl, CURLINFO_PRIVATE, &privateData) != CURLE_OK
+                        || !privateData)
+                        continue;
+                    request = (struct OTAsyncRequest *)privateData;
+                    delay = OTHttpRetryDelay (request->session, &request->http, res);
+                    if (delay < 0)
+                        switch (OTHttpReauthorise (request->session, &request->http, res))
+                            {
+                            case 0:
+                                delay = 0;
+                                break;
+                            case 1:
+                                request->isTokenWaiting = 1;
+                                delay = OTASYNC_TOKEN_POLL;
+                                break;
+                            }
+                    delay = OTHttpLimitAcquire (request->session, &request->http, delay);
+                    if (delay >= 0)
+                        {
+                            request->state = ASYNC_WAITING;
+                            request->retryAt = OTHttpTime () + delay;
+                            OTAsyncQueuePush (&ptr->waiting, request);
+                            continue;
+                        }
+                    ptr->running -= 1;
+                    OTAsyncComplete (request, res);
+                }
+        }
+
+    /* Callbacks may submit new requests. */
+    while ((request = OTAsyncQueuePop (&ptr->callbacks)))
+        {
+            request->callback (request->container, request->containerType, request->status,
+                               request->userData);
+            OTAsyncRecycle (request);
+        }
+    return ptr->running;
+}
+
+/* Read a finished request that was created without a callback.
+ * Returns 0 if a result was read and -1 if no result is available. */
+int
+OTAsyncRead (void *async, void **container, enum OTTypes *type, enum OTStatus *status,
+             void **userData)
+{
+    struct OTAsyncContainer *ptr = (struct OTAsyncContainer *)async;
+    struct OTAsyncRequest *request = NULL;
+    if (!ptr) return -1;
+
+    request = OTAsyncQueuePop (&ptr->results);
+    if (!request) return -1;
+    if (container) *container = request->container;
+    if (type) *type = request->containerType;
+    if (status) *status = request->status;
+    if (userData) *userData = request->userData;
+    OTAsyncRecycle (request);
+    return 0;
+}
+
+/* Abort all transfers and free the engine. Unread results are deallocated. */
+void
+OTAsyncCleanup (void *async)
+{
+    struct OTAsyncContainer *ptr = (struct OTAsyncContainer *)async;
+    struct OTAsyncRequest *request = NULL;
+    struct OTAsyncRequest *next = NULL;
+    if (!ptr) return;
+
+    for (request = ptr->requests; request; request = next)
+        {
+            next = request->nextAll;
+            if (request->state == ASYNC_RUNNING)
+                curl_multi_remove_handle (ptr->multi, request->handle->curl);
+            if (request->state == ASYNC_RUNNING || request->state == ASYNC_WAITING)
+                {
+                    OTAsyncKeysFree (request);
+                    OTJsonDelete (request->http.staleTree);
+                    free (request->http.staleEntityTag);
+                }
+            else if (request->state == ASYNC_DONE)
+                OTDeallocContainer (request->container, request->containerType);
+            OTHttpThreadHandleCleanup (request->handle);
+            free (request);
+        }
+    curl_multi_cleanup (ptr->multi);
+    free (ptr);
+}
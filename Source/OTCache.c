@@ -0,0 +1,555 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* openTIDAL metadata response cache
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "OTHelper.h"
+#include "OTHttp.h"
+#include "OTJson.h"
+#include "openTIDAL.h"
+
+#define OTCACHE_BUCKETS 1024
+
+/* Default time to live of the cacheable endpoint families in seconds. The first matching
+ * prefix is used. Playlists are not cached, they are edited by their users. */
+static const struct
+{
+    const char *prefix;
+    const char *family;
+    long ttl;
+} OTCacheTTLs[] = {
+    { "/v1/albums/", "albums", 3600 },       { "/v1/artists/", "artists", 3600 },
+    { "/v1/tracks/", "tracks", 3600 },       { "/v1/videos/", "videos", 3600 },
+    { "/v1/mixes/", "mixes", 900 },          { "/v1/pages/", "pages", 300 },
+};
+
+#define OTCACHE_FAMILIES (sizeof (OTCacheTTLs) / sizeof (OTCacheTTLs[0]))
+
+struct OTCacheEntry
+{
+    char *key;
+    unsigned long hash;
+    struct OTJsonContainer *tree;
+    /* Entity-tag of the response. Expired entries with one are kept for revalidation. */
+    char *entityTag;
+    /* Approximated memory of the entry. */
+    size_t size;
+    /* Past the soft expiry the entry is served while a background refresh runs. Past the
+     * hard expiry it is not served anymore. */
+    long long softExpires;
+    long long expires;
+    int isRefreshing;
+    /* Set by a hit, cleared by the clock hand. */
+    int isReferenced;
+    /* Readers duplicating the tree outside the lock. An evicted entry is freed by the
+     * last reader. */
+    int references;
+    int isEvicted;
+    struct OTCacheEntry *bucketNext;
+    /* Circular clock list. */
+    struct OTCacheEntry *clockPrev;
+    struct OTCacheEntry *clockNext;
+};
+
+struct OTCacheContainer
+{
+    pthread_mutex_t mutex;
+    size_t budget;
+    size_t size;
+    struct OTCacheEntry *buckets[OTCACHE_BUCKETS];
+    struct OTCacheEntry *hand;
+    /* Soft and hard time to live of each endpoint family in milliseconds. */
+    long long softTTL[OTCACHE_FAMILIES];
+    long long hardTTL[OTCACHE_FAMILIES];
+};
+
+/* A background refresh of an entry served past its soft expiry. */
+struct OTCacheRefresh
+{
+    struct OTSessionContainer *session;
+    struct OTHttpContainer http;
+    enum OTHttpTypes type;
+};
+
+/* Allocate a cache with a memory budget in bytes. The cache can be shared by many sessions
+ * and threads. */
+void *
+OTCacheCreate (const size_t budget)
+{
+    struct OTCacheContainer *cache = NULL;
+    size_t i;
+    cache = malloc (sizeof (struct OTCacheContainer));
+    if (!cache) return NULL;
+    if (pthread_mutex_init (&cache->mutex, NULL) != 0)
+        {
+            free (cache);
+            return NULL;
+        }
+    cache->budget = budget;
+    cache->size = 0;
+    memset (cache->buckets, 0, sizeof (cache->buckets));
+    cache->hand = NULL;
+    for (i = 0; i < OTCACHE_FAMILIES; i++)
+        cache->softTTL[i] = cache->hardTTL[i] = (long long)OTCacheTTLs[i].ttl * 1000;
+    return cache;
+}
+
+/* Set the soft and hard time to live of an endpoint family in seconds. An entry past its
+ * soft time to live is served while a background request refreshes it. Returns 0 on success,
+ * -1 if the family is unknown or the hard time to live is smaller than the soft one. */
+int
+OTCacheLifetime (void *cache, const char *const family, const long softTTL, const long hardTTL)
+{
+    struct OTCacheContainer *ptr = (struct OTCacheContainer *)cache;
+    size_t i;
+    if (!ptr || softTTL < 0 || hardTTL < softTTL) return -1;
+    for (i = 0; i < OTCACHE_FAMILIES; i++)
+        if (strcmp (family, OTCacheTTLs[i].family) == 0)
+            {
+                ptr->softTTL[i] = (long long)softTTL * 1000;
+                ptr->hardTTL[i] = (long long)hardTTL * 1000;
+                return 0;
+            }
+    return -1;
+}
+
+static void
+OTCacheEntryFree (struct OTCacheEntry *const entry)
+{
+    OTJsonDelete (entry->tree);
+    free (entry->entityTag);
+    free (entry->key);
+    free (entry);
+}
+
+/* Unlink an entry from the bucket and the clock list. Must be called with the lock held. */
+static void
+OTCacheEvict (struct OTCacheContainer *const cache, struct OTCacheEntry *const entry)
+{
+    struct OTCacheEntry **link = &cache->buckets[entry->hash % OTCACHE_BUCKETS];
+    for (; *link; link = &(*link)->bucketNext)
+        if (*link == entry)
+            {
+                *link = entry->bucketNext;
+                break;
+            }
+    if (entry->clockNext == entry)
+        cache->hand = NULL;
+    else
+        {
+            entry->clockPrev->clockNext = entry->clockNext;
+            entry->clockNext->clockPrev = entry->clockPrev;
+            if (cache->hand == entry) cache->hand = entry->clockNext;
+        }
+    cache->size -= entry->size;
+    entry->isEvicted = 1;
+    if (entry->references == 0) OTCacheEntryFree (entry);
+}
+
+void
+OTCacheCleanup (void *cache)
+{
+    struct OTCacheContainer *ptr = (struct OTCacheContainer *)cache;
+    if (!ptr) return;
+    while (ptr->hand)
+        OTCacheEvict (ptr, ptr->hand);
+    pthread_mutex_destroy (&ptr->mutex);
+    free (ptr);
+}
+
+/* Attach a cache to a session. NULL detaches it. The cache must outlive the session. */
+void
+OTSessionCache (struct OTSessionContainer *const session, void *cache)
+{
+    session->cache = cache;
+}
+
+/* Soft time to live of an endpoint in milliseconds, 0 if it is not cacheable. The
+ * lifetimes of the attached metadata cache take precedence over the defaults. */
+long long
+OTCacheTTL (const struct OTSessionContainer *const session, const char *const endpoint,
+            long long *hardTTL)
+{
+    const struct OTCacheContainer *cache = (const struct OTCacheContainer *)session->cache;
+    long long ttl;
+    size_t i;
+    for (i = 0; i < OTCACHE_FAMILIES; i++)
+        if (strncmp (endpoint, OTCacheTTLs[i].prefix, strlen (OTCacheTTLs[i].prefix)) == 0)
+            {
+                ttl = (long long)OTCacheTTLs[i].ttl * 1000;
+                if (hardTTL) *hardTTL = cache ? cache->hardTTL[i] : ttl;
+                return cache ? cache->softTTL[i] : ttl;
+            }
+    return 0;
+}
+
+/* The key is partitioned by the countryCode of the session and, for personalised
+ * responses, by the user. */
+char *
+OTCacheKey (const struct OTSessionContainer *const session,
+            const struct OTHttpContainer *const http, unsigned long *hash)
+{
+    char *key = NULL;
+    const char *c = NULL;
+    OTConcatenateString (&key, "%s %s %s%s?%s", session->countryCode,
+                         http->isPrivate && session->userId ? session->userId : "",
+                         session->baseUrl, http->endpoint, http->parameter ? http->parameter : "");
+    if (!key) return NULL;
+    *hash = 5381;
+    for (c = key; *c; c++)
+        *hash = *hash * 33 + (unsigned char)*c;
+    return key;
+}
+
+/* Approximate the memory used by a tree. */
+static size_t
+OTCacheTreeSize (const struct OTJsonContainer *item)
+{
+    size_t size = 0;
+    for (; item; item = item->next)
+        {
+            size += sizeof (struct OTJsonContainer);
+            if (item->valuestring) size += strlen (item->valuestring) + 1;
+            if (item->valueintstring) size += strlen (item->valueintstring) + 1;
+            if (item->string) size += strlen (item->string) + 1;
+            size += OTCacheTreeSize (item->child);
+        }
+    return size;
+}
+
+static struct OTCacheEntry *
+OTCacheFind (struct OTCacheContainer *const cache, const char *const key,
+             const unsigned long hash)
+{
+    struct OTCacheEntry *entry = cache->buckets[hash % OTCACHE_BUCKETS];
+    for (; entry; entry = entry->bucketNext)
+        if (entry->hash == hash && strcmp (entry->key, key) == 0) return entry;
+    return NULL;
+}
+
+/* Allow a new refresh of an entry after a failed one. */
+static void
+OTCacheRefreshAbort (const struct OTSessionContainer *const session,
+                     const struct OTHttpContainer *const http)
+{
+    struct OTCacheContainer *cache = (struct OTCacheContainer *)session->cache;
+    struct OTCacheEntry *entry = NULL;
+    unsigned long hash;
+    char *key = NULL;
+    if (!cache) return;
+    key = OTCacheKey (session, http, &hash);
+    if (!key) return;
+    pthread_mutex_lock (&cache->mutex);
+    entry = OTCacheFind (cache, key, hash);
+    if (entry) entry->isRefreshing = 0;
+    pthread_mutex_unlock (&cache->mutex);
+    free (key);
+}
+
+static void *
+OTCacheRefreshRun (void *arg)
+{
+    struct OTCacheRefresh *refresh = (struct OTCacheRefresh *)arg;
+    struct OTSessionContainer *session = refresh->session;
+    struct OTHttpContainer *http = &refresh->http;
+
+    http->type = &refresh->type;
+    http->handle = (struct OTHttpHandle *)OTHttpThreadHandleCreate ();
+    if (http->handle)
+        {
+            OTHttpRequest (session, http);
+            OTCacheRevalidate (session, http);
+        }
+    if (http->tree && http->httpOk == 0 && http->responseCode == 200)
+        {
+            OTCacheStore (session, http);
+            OTDiskCacheStore (session, http);
+        }
+    else
+        OTCacheRefreshAbort (session, http);
+
+    OTHttpThreadHandleCleanup (http->handle);
+    free (http->response);
+    free (http->entityTag);
+    free (http->staleEntityTag);
+    free (http->endpoint);
+    free (http->parameter);
+    OTJsonDelete (http->tree);
+    OTJsonDelete (http->staleTree);
+    free (refresh);
+    OTHttpRefreshEnd (session);
+    return NULL;
+}
+
+/* Refresh an entry served past its soft expiry on a detached thread. The entity-tag is
+ * consumed. OTSessionCleanup waits for running refreshes. */
+void
+OTCacheRefreshStart (const struct OTSessionContainer *const session,
+                     const struct OTHttpContainer *const http,
+                     const struct OTJsonContainer *const tree, char *entityTag)
+{
+    struct OTCacheRefresh *refresh = NULL;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int isStarted = 0;
+
+    refresh = malloc (sizeof (struct OTCacheRefresh));
+    if (!refresh) goto end;
+    /* The refresh only uses the session objects which are safe to share between threads. */
+    refresh->session = (struct OTSessionContainer *)session;
+    refresh->type = GET;
+    OTHttpContainerInit (&refresh->http);
+    refresh->http.isCacheable = 1;
+    refresh->http.isPrivate = http->isPrivate;
+    refresh->http.isStreamParsed = 1;
+    refresh->http.endpoint = strdup (http->endpoint);
+    if (http->parameter) refresh->http.parameter = strdup (http->parameter);
+    if (!refresh->http.endpoint || (http->parameter && !refresh->http.parameter)) goto end;
+    if (entityTag && tree)
+        {
+            refresh->http.staleTree = OTJsonDuplicate (tree, 1);
+            if (refresh->http.staleTree)
+                {
+                    refresh->http.staleEntityTag = entityTag;
+                    entityTag = NULL;
+                }
+        }
+
+    if (session->verboseMode) fprintf (stderr, "* Refresh in background %s\n", http->endpoint);
+    if (OTHttpRefreshBegin (session) != 0) goto end;
+    if (pthread_attr_init (&attr) == 0)
+        {
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+            isStarted = pthread_create (&thread, &attr, OTCacheRefreshRun, refresh) == 0;
+            pthread_attr_destroy (&attr);
+        }
+    if (!isStarted) OTHttpRefreshEnd (session);
+end:
+    free (entityTag);
+    if (isStarted) return;
+    if (refresh)
+        {
+            free (refresh->http.endpoint);
+            free (refresh->http.parameter);
+            free (refresh->http.staleEntityTag);
+            OTJsonDelete (refresh->http.staleTree);
+            free (refresh);
+        }
+    OTCacheRefreshAbort (session, http);
+}
+
+/* Look up a cacheable request. On a hit the OTHttpContainer is filled with a duplicate of
+ * the cached tree as if the request was performed. Returns 1 on a hit, 0 otherwise.
+ * An expired entry with an entity-tag is handed to the OTHttpContainer for revalidation.
+ * An entry past its soft expiry is returned and refreshed in the background, once. */
+int
+OTCacheLookup (const struct OTSessionContainer *const session, struct OTHttpContainer *const http)
+{
+    struct OTCacheContainer *cache = (struct OTCacheContainer *)session->cache;
+    struct OTCacheEntry *entry = NULL;
+    struct OTJsonContainer *tree = NULL;
+    unsigned long hash;
+    char *key = NULL;
+    char *entityTag = NULL;
+    long long now;
+    int isStale = 0;
+    int isRefreshed = 0;
+    int isTagged;
+
+    if (!cache || !http->isCacheable || !http->endpoint
+        || !OTCacheTTL (session, http->endpoint, NULL))
+        return 0;
+    key = OTCacheKey (session, http, &hash);
+    if (!key) return 0;
+
+    pthread_mutex_lock (&cache->mutex);
+    now = OTHttpTime ();
+    entry = OTCacheFind (cache, key, hash);
+    if (entry && entry->expires <= now)
+        {
+            isStale = 1;
+            /* Without an entity-tag it can only serve as an offline fallback. */
+            if (!entry->entityTag && !session->offlineFallback)
+                {
+                    OTCacheEvict (cache, entry);
+                    entry = NULL;
+                }
+        }
+    if (entry)
+        {
+            if (!isStale) entry->isReferenced = 1;
+            if (!isStale && entry->softExpires <= now && !entry->isRefreshing)
+                entry->isRefreshing = isRefreshed = 1;
+            entry->references += 1;
+        }
+    pthread_mutex_unlock (&cache->mutex);
+    free (key);
+    if (!entry) return 0;
+
+    tree = OTJsonDuplicate (entry->tree, 1);
+    isTagged = entry->entityTag != NULL;
+    if ((isStale || isRefreshed) && isTagged) entityTag = strdup (entry->entityTag);
+    pthread_mutex_lock (&cache->mutex);
+    entry->references -= 1;
+    if (entry->isEvicted && entry->references == 0) OTCacheEntryFree (entry);
+    pthread_mutex_unlock (&cache->mutex);
+    if (isStale)
+        {
+            /* A revalidation needs both. */
+            if (!tree || (isTagged && !entityTag))
+                {
+                    OTJsonDelete (tree);
+                    free (entityTag);
+                    return 0;
+                }
+            http->staleTree = tree;
+            http->staleEntityTag = entityTag;
+            return 0;
+        }
+    if (isRefreshed) OTCacheRefreshStart (session, http, tree, entityTag);
+    if (!tree) return 0;
+    http->tree = tree;
+
+    if (session->verboseMode) fprintf (stderr, "* Cache hit %s\n", http->endpoint);
+    http->httpOk = 0;
+    http->responseCode = 200;
+    http->isStreamParsed = 1;
+    return 1;
+}
+
+/* Store a successful response. The tree of the OTHttpContainer is duplicated. Entries are
+ * evicted with the CLOCK algorithm until the cache fits into the budget. */
+void
+OTCacheStore (const struct OTSessionContainer *const session,
+              const struct OTHttpContainer *const http)
+{
+    struct OTCacheContainer *cache = (struct OTCacheContainer *)session->cache;
+    struct OTCacheEntry *entry = NULL;
+    struct OTCacheEntry *previous = NULL;
+    long long ttl;
+    long long hardTTL;
+
+    if (!cache || !http->isCacheable || !http->tree || http->httpOk != 0
+        || http->responseCode != 200 || http->isOffline || !http->endpoint)
+        return;
+    ttl = OTCacheTTL (session, http->endpoint, &hardTTL);
+    if (!ttl) return;
+
+    entry = malloc (sizeof (struct OTCacheEntry));
+    if (!entry) return;
+    entry->key = OTCacheKey (session, http, &entry->hash);
+    entry->tree = OTJsonDuplicate (http->tree, 1);
+    entry->entityTag = http->entityTag ? strdup (http->entityTag) : NULL;
+    if (!entry->key || !entry->tree || (http->entityTag && !entry->entityTag))
+        {
+            OTCacheEntryFree (entry);
+            return;
+        }
+    entry->size = sizeof (struct OTCacheEntry) + strlen (entry->key) + 1
+                  + OTCacheTreeSize (entry->tree);
+    if (entry->entityTag) entry->size += strlen (entry->entityTag) + 1;
+    entry->softExpires = OTHttpTime () + ttl;
+    entry->expires = entry->softExpires - ttl + hardTTL;
+    entry->isRefreshing = 0;
+    entry->isReferenced = 0;
+    entry->references = 0;
+    entry->isEvicted = 0;
+    if (entry->size > cache->budget)
+        {
+            OTCacheEntryFree (entry);
+            return;
+        }
+
+    pthread_mutex_lock (&cache->mutex);
+    previous = OTCacheFind (cache, entry->key, entry->hash);
+    if (previous) OTCacheEvict (cache, previous);
+    while (cache->hand && cache->size + entry->size > cache->budget)
+        {
+            if (cache->hand->isReferenced)
+                {
+                    cache->hand->isReferenced = 0;
+                    cache->hand = cache->hand->clockNext;
+                }
+            else
+                OTCacheEvict (cache, cache->hand);
+        }
+    entry->bucketNext = cache->buckets[entry->hash % OTCACHE_BUCKETS];
+    cache->buckets[entry->hash % OTCACHE_BUCKETS] = entry;
+    /* Insert behind the hand, so the new entry is inspected last. */
+    if (!cache->hand)
+        {
+            entry->clockPrev = entry->clockNext = entry;
+            cache->hand = entry;
+        }
+    else
+        {
+            entry->clockNext = cache->hand;
+            entry->clockPrev = cache->hand->clockPrev;
+            cache->hand->clockPrev->clockNext = entry;
+            cache->hand->clockPrev = entry;
+        }
+    cache->size += entry->size;
+    pthread_mutex_unlock (&cache->mutex);
+}
+
+/* Reuse the stale tree if the origin answered 304 Not Modified. The OTHttpContainer is
+ * turned into a successful response, so it is stored again with a new expiry. */
+void
+OTCacheRevalidate (const struct OTSessionContainer *const session,
+                   struct OTHttpContainer *const http)
+{
+    if (!http->staleTree || http->httpOk != 0 || http->responseCode != 304) return;
+    if (session->verboseMode) fprintf (stderr, "* Not modified %s\n", http->endpoint);
+    OTJsonDelete (http->tree);
+    http->tree = http->staleTree;
+    http->staleTree = NULL;
+    if (!http->entityTag)
+        {
+            http->entityTag = http->staleEntityTag;
+            http->staleEntityTag = NULL;
+        }
+    http->responseCode = 200;
+    http->isRevalidated = 1;
+}
+
+/* Return the stale tree if the request failed in the transport or was rejected by the
+ * circuit breaker and the offline fallback of the session is enabled. */
+void
+OTCacheFallback (const struct OTSessionContainer *const session,
+                 struct OTHttpContainer *const http)
+{
+    if (!session->offlineFallback || !http->staleTree || http->httpOk != -1 || http->isCancelled)
+        return;
+    if (session->verboseMode) fprintf (stderr, "* Offline fallback %s\n", http->endpoint);
+    http->tree = http->staleTree;
+    http->staleTree = NULL;
+    http->httpOk = 0;
+    http->responseCode = 200;
+    http->isStreamParsed = 1;
+    http->isOffline = 1;
+}
@@ -48,12 +48,16 @@ OTDeallocContainer (void *container, enum OTTypes type)
                 case CONTENT_CONTAINER:
                     singleContainer = (struct OTContentContainer *)container;
                     OTJsonDelete (singleContainer->tree);
+                    free (singleContainer->headers.entityTag);
+                    free (singleContainer->headers.cacheControl);
                     free (singleContainer);
                     break;
                 case CONTENT_STREAM_CONTAINER:
                     streamContainer = (struct OTContentStreamContainer *)container;
                     OTJsonDelete (streamContainer->tree);
                     OTJsonDelete (streamContainer->manifest);
+                    free (streamContainer->headers.entityTag);
+                    free (streamContainer->headers.cacheControl);
                     free (streamContainer);
                     break;
                 }
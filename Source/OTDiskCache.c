@@ -0,0 +1,606 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* openTIDAL persistent response cache
+ * An append-only segment file stores the records (key, entity-tag, body and expiry).
+ * A memory-mapped open-addressing hash table indexes the records. A restarted process
+ * maps the index and starts with a warm cache. Processes sharing the directory serialise
+ * their access with an flock on the index file.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "OTHelper.h"
+#include "OTHttp.h"
+#include "OTJson.h"
+#include "openTIDAL.h"
+
+#define OTDISKCACHE_MAGIC 0x4f544443
+#define OTDISKCACHE_VERSION 2
+/* Slots inspected for a key before the oldest one is replaced. */
+#define OTDISKCACHE_PROBES 32
+/* Seconds until a record served past its soft expiry is refreshed again. */
+#define OTDISKCACHE_REFRESH 30
+
+struct OTDiskCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t slots;
+};
+
+struct OTDiskCacheSlot
+{
+    uint64_t hash;
+    /* Offset of the record in the segment. 0 if the slot is empty. */
+    uint64_t offset;
+    /* Soft and hard expiry like the entries of the metadata response cache. */
+    int64_t softExpires;
+    int64_t expires;
+};
+
+struct OTDiskCacheRecord
+{
+    uint32_t magic;
+    uint32_t keyLength;
+    uint32_t entityTagLength;
+    uint32_t bodyLength;
+    int64_t softExpires;
+    int64_t expires;
+};
+
+/* A record kept by the compaction. */
+struct OTDiskCacheLive
+{
+    struct OTDiskCacheSlot slot;
+    uint64_t size;
+};
+
+struct OTDiskCacheContainer
+{
+    pthread_mutex_t mutex;
+    int segment;
+    int index;
+    /* Maximum size of the segment. The cache is compacted if it is exceeded. */
+    uint64_t capacity;
+    uint64_t end;
+    struct OTDiskCacheHeader *header;
+    struct OTDiskCacheSlot *slots;
+    size_t mapLength;
+};
+
+/* 64-bit FNV-1a. 0 is reserved. */
+static uint64_t
+OTDiskCacheHash (const char *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *key; key++)
+        {
+            hash ^= (unsigned char)*key;
+            hash *= 1099511628211ULL;
+        }
+    return hash ? hash : 1;
+}
+
+/* Take the lock of the threads of this process and the one of the processes sharing the
+ * files. Other processes may have appended to or reset the segment in the meantime. */
+static int
+OTDiskCacheLock (struct OTDiskCacheContainer *const cache)
+{
+    struct stat st;
+    pthread_mutex_lock (&cache->mutex);
+    if (flock (cache->index, LOCK_EX) != 0)
+        {
+            pthread_mutex_unlock (&cache->mutex);
+            return -1;
+        }
+    if (fstat (cache->segment, &st) == 0) cache->end = st.st_size;
+    return 0;
+}
+
+static void
+OTDiskCacheUnlock (struct OTDiskCacheContainer *const cache)
+{
+    flock (cache->index, LOCK_UN);
+    pthread_mutex_unlock (&cache->mutex);
+}
+
+/* Discard all records. Must be called with the lock held. */
+static int
+OTDiskCacheReset (struct OTDiskCacheContainer *const cache)
+{
+    const uint32_t magic = OTDISKCACHE_MAGIC;
+    memset (cache->slots, 0, cache->header->slots * sizeof (struct OTDiskCacheSlot));
+    if (ftruncate (cache->segment, 0) != 0) return -1;
+    if (pwrite (cache->segment, &magic, sizeof (magic), 0) != sizeof (magic)) return -1;
+    cache->end = sizeof (uint64_t);
+    return 0;
+}
+
+/* Order records by their offset, the oldest first. */
+static int
+OTDiskCacheCompare (const void *a, const void *b)
+{
+    const struct OTDiskCacheLive *x = (const struct OTDiskCacheLive *)a;
+    const struct OTDiskCacheLive *y = (const struct OTDiskCacheLive *)b;
+    return (x->slot.offset > y->slot.offset) - (x->slot.offset < y->slot.offset);
+}
+
+/* Copy a record towards the start of the segment. */
+static int
+OTDiskCacheMove (struct OTDiskCacheContainer *const cache, uint64_t from, uint64_t to,
+                 uint64_t size)
+{
+    char buffer[16384];
+    size_t length;
+    while (size > 0)
+        {
+            length = size < sizeof (buffer) ? size : sizeof (buffer);
+            if (pread (cache->segment, buffer, length, from) != (ssize_t)length
+                || pwrite (cache->segment, buffer, length, to) != (ssize_t)length)
+                return -1;
+            from += length;
+            to += length;
+            size -= length;
+        }
+    return 0;
+}
+
+/* Make room for a record of size bytes. Records past their hard expiry and records no longer
+ * indexed are dropped, then the oldest ones until the record fits. The rest is moved to the
+ * start of the segment and indexed again. Must be called with the lock held. */
+static int
+OTDiskCacheCompact (struct OTDiskCacheContainer *const cache, const uint64_t size)
+{
+    struct OTDiskCacheLive *live = NULL;
+    struct OTDiskCacheRecord record;
+    struct OTDiskCacheSlot *slot = NULL;
+    uint64_t mask = cache->header->slots - 1;
+    uint64_t count = 0;
+    uint64_t total = sizeof (uint64_t);
+    uint64_t first = 0;
+    uint64_t i;
+    uint64_t j;
+    int64_t now = time (NULL);
+    int status = -1;
+
+    live = malloc (cache->header->slots * sizeof (struct OTDiskCacheLive));
+    if (!live) return OTDiskCacheReset (cache);
+    for (i = 0; i < cache->header->slots; i++)
+        {
+            slot = &cache->slots[i];
+            if (!slot->offset || slot->expires <= now) continue;
+            if (pread (cache->segment, &record, sizeof (record), slot->offset) != sizeof (record)
+                || record.magic != OTDISKCACHE_MAGIC)
+                continue;
+            live[count].slot = *slot;
+            live[count].size = sizeof (record) + record.keyLength + record.entityTagLength
+                               + record.bodyLength;
+            if (slot->offset + live[count].size > cache->end) continue;
+            total += live[count].size;
+            count += 1;
+        }
+    qsort (live, count, sizeof (struct OTDiskCacheLive), OTDiskCacheCompare);
+    while (first < count && total + size > cache->capacity)
+        total -= live[first++].size;
+
+    /* An interrupted compaction leaves an empty index behind. */
+    memset (cache->slots, 0, cache->header->slots * sizeof (struct OTDiskCacheSlot));
+    cache->end = sizeof (uint64_t);
+    for (i = first; i < count; i++)
+        {
+            if (live[i].slot.offset != cache->end
+                && OTDiskCacheMove (cache, live[i].slot.offset, cache->end, live[i].size) != 0)
+                break;
+            live[i].slot.offset = cache->end;
+            cache->end += live[i].size;
+        }
+    if (i == count && ftruncate (cache->segment, cache->end) == 0)
+        {
+            for (i = first; i < count; i++)
+                for (j = 0; j < OTDISKCACHE_PROBES; j++)
+                    {
+                        slot = &cache->slots[(live[i].slot.hash + j) & mask];
+                        if (slot->offset) continue;
+                        *slot = live[i].slot;
+                        break;
+                    }
+            status = 0;
+        }
+    else
+        status = OTDiskCacheReset (cache);
+    free (live);
+    return status;
+}
+
+/* Open or create the cache files in a directory. The capacity limits the segment file in
+ * bytes. The index has one slot per kilobyte of capacity. If a record does not fit, the
+ * expired records and then the oldest ones are dropped and the segment is compacted. */
+void *
+OTDiskCacheOpen (const char *const directory, const size_t capacity)
+{
+    struct OTDiskCacheContainer *cache = NULL;
+    struct stat st;
+    char *path = NULL;
+    uint64_t slots = 1024;
+    int isNew = 0;
+
+    cache = malloc (sizeof (struct OTDiskCacheContainer));
+    if (!cache) return NULL;
+    cache->segment = -1;
+    cache->index = -1;
+    cache->header = NULL;
+    cache->capacity = capacity;
+    if (pthread_mutex_init (&cache->mutex, NULL) != 0)
+        {
+            free (cache);
+            return NULL;
+        }
+
+    OTConcatenateString (&path, "%s/openTIDAL.segment", directory);
+    if (!path) goto error;
+    cache->segment = open (path, O_RDWR | O_CREAT, 0600);
+    free (path);
+    path = NULL;
+    OTConcatenateString (&path, "%s/openTIDAL.index", directory);
+    if (!path) goto error;
+    cache->index = open (path, O_RDWR | O_CREAT, 0600);
+    free (path);
+    if (cache->segment == -1 || cache->index == -1) goto error;
+    /* Another process may be creating the files. Closing the index releases the lock. */
+    if (flock (cache->index, LOCK_EX) != 0) goto error;
+
+    /* Map the index. A new or incompatible index is recreated. */
+    if (fstat (cache->index, &st) != 0) goto error;
+    if ((size_t)st.st_size < sizeof (struct OTDiskCacheHeader))
+        {
+            while (slots < capacity / 1024)
+                slots *= 2;
+            isNew = 1;
+        }
+    else
+        {
+            struct OTDiskCacheHeader header;
+            if (pread (cache->index, &header, sizeof (header), 0) != sizeof (header)) goto error;
+            slots = header.slots;
+            if (header.magic != OTDISKCACHE_MAGIC || header.version != OTDISKCACHE_VERSION
+                || slots == 0 || (slots & (slots - 1))
+                || (size_t)st.st_size
+                       != sizeof (struct OTDiskCacheHeader)
+                              + slots * sizeof (struct OTDiskCacheSlot))
+                {
+                    slots = 1024;
+                    while (slots < capacity / 1024)
+                        slots *= 2;
+                    isNew = 1;
+                }
+        }
+    cache->mapLength = sizeof (struct OTDiskCacheHeader) + slots * sizeof (struct OTDiskCacheSlot);
+    if (isNew && ftruncate (cache->index, cache->mapLength) != 0) goto error;
+    cache->header = mmap (NULL, cache->mapLength, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          cache->index, 0);
+    if (cache->header == MAP_FAILED)
+        {
+            cache->header = NULL;
+            goto error;
+        }
+    cache->slots = (struct OTDiskCacheSlot *)(cache->header + 1);
+
+    if (fstat (cache->segment, &st) != 0) goto error;
+    cache->end = st.st_size;
+    if (isNew || cache->end < sizeof (uint64_t))
+        {
+            cache->header->magic = OTDISKCACHE_MAGIC;
+            cache->header->version = OTDISKCACHE_VERSION;
+            cache->header->slots = slots;
+            if (OTDiskCacheReset (cache) != 0) goto error;
+        }
+    flock (cache->index, LOCK_UN);
+    return cache;
+error:
+    OTDiskCacheClose (cache);
+    return NULL;
+}
+
+void
+OTDiskCacheClose (void *diskCache)
+{
+    struct OTDiskCacheContainer *cache = (struct OTDiskCacheContainer *)diskCache;
+    if (!cache) return;
+    if (cache->header)
+        {
+            msync (cache->header, cache->mapLength, MS_SYNC);
+            munmap (cache->header, cache->mapLength);
+        }
+    if (cache->segment != -1) close (cache->segment);
+    if (cache->index != -1) close (cache->index);
+    pthread_mutex_destroy (&cache->mutex);
+    free (cache);
+}
+
+/* Attach a disk cache to a session. NULL detaches it. The cache must outlive the session. */
+void
+OTSessionDiskCache (struct OTSessionContainer *const session, void *diskCache)
+{
+    session->diskCache = diskCache;
+}
+
+/* Read the header of a record and check that it belongs to the key. Must be called with
+ * the lock held. Returns 0 on success. */
+static int
+OTDiskCacheMatch (struct OTDiskCacheContainer *const cache,
+                  const struct OTDiskCacheSlot *const slot, const char *const key,
+                  struct OTDiskCacheRecord *const record)
+{
+    size_t keyLength = strlen (key);
+    char *buffer = NULL;
+    int status = -1;
+
+    if (pread (cache->segment, record, sizeof (*record), slot->offset) != sizeof (*record))
+        return -1;
+    if (record->magic != OTDISKCACHE_MAGIC || record->keyLength != keyLength) return -1;
+    if (slot->offset + sizeof (*record) + record->keyLength + record->entityTagLength
+            + record->bodyLength
+        > cache->end)
+        return -1;
+    buffer = malloc (keyLength);
+    if (!buffer) return -1;
+    if (pread (cache->segment, buffer, keyLength, slot->offset + sizeof (*record))
+            == (ssize_t)keyLength
+        && memcmp (buffer, key, keyLength) == 0)
+        status = 0;
+    free (buffer);
+    return status;
+}
+
+/* Read the record of a slot if it belongs to the key. Must be called with the lock held.
+ * Returns the allocated body or NULL. */
+static char *
+OTDiskCacheRead (struct OTDiskCacheContainer *const cache,
+                 const struct OTDiskCacheSlot *const slot, const char *const key,
+                 char **entityTag)
+{
+    struct OTDiskCacheRecord record;
+    char *buffer = NULL;
+    char *body = NULL;
+    off_t offset;
+
+    if (OTDiskCacheMatch (cache, slot, key, &record) != 0) return NULL;
+    offset = slot->offset + sizeof (record) + record.keyLength;
+    buffer = malloc (record.entityTagLength + 1);
+    body = malloc (record.bodyLength + 1);
+    if (!buffer || !body) goto error;
+    if (pread (cache->segment, buffer, record.entityTagLength, offset)
+        != (ssize_t)record.entityTagLength)
+        goto error;
+    offset += record.entityTagLength;
+    if (pread (cache->segment, body, record.bodyLength, offset) != (ssize_t)record.bodyLength)
+        goto error;
+    body[record.bodyLength] = '\0';
+    if (record.entityTagLength)
+        {
+            buffer[record.entityTagLength] = '\0';
+            *entityTag = buffer;
+        }
+    else
+        free (buffer);
+    return body;
+error:
+    free (buffer);
+    free (body);
+    return NULL;
+}
+
+/* Look up a cacheable request. On a hit the stored body is parsed into the
+ * OTHttpContainer as if the request was performed. Returns 1 on a hit, 0 otherwise.
+ * An expired record with an entity-tag is handed to the OTHttpContainer for revalidation.
+ * A record past its soft expiry is returned and refreshed in the background. */
+int
+OTDiskCacheLookup (const struct OTSessionContainer *const session,
+                   struct OTHttpContainer *const http)
+{
+    struct OTDiskCacheContainer *cache = (struct OTDiskCacheContainer *)session->diskCache;
+    struct OTDiskCacheSlot *slot = NULL;
+    unsigned long unused;
+    uint64_t hash;
+    uint64_t mask;
+    uint64_t i;
+    char *key = NULL;
+    char *body = NULL;
+    char *entityTag = NULL;
+    struct OTJsonContainer *tree = NULL;
+    int64_t now = time (NULL);
+    int isStale = 0;
+    int isRefreshed = 0;
+
+    if (!cache || !http->isCacheable || !http->endpoint
+        || !OTCacheTTL (session, http->endpoint, NULL))
+        return 0;
+    key = OTCacheKey (session, http, &unused);
+    if (!key) return 0;
+    hash = OTDiskCacheHash (key);
+
+    if (OTDiskCacheLock (cache) != 0)
+        {
+            free (key);
+            return 0;
+        }
+    mask = cache->header->slots - 1;
+    for (i = 0; i < OTDISKCACHE_PROBES && !body; i++)
+        {
+            slot = &cache->slots[(hash + i) & mask];
+            if (!slot->offset) break;
+            if (slot->hash != hash) continue;
+            isStale = slot->expires <= now;
+            if (!isStale || !http->staleTree)
+                body = OTDiskCacheRead (cache, slot, key, &entityTag);
+            /* Other threads and processes skip the refresh for a while. */
+            if (body && !isStale && slot->softExpires <= now)
+                {
+                    slot->softExpires = now + OTDISKCACHE_REFRESH;
+                    if (slot->softExpires > slot->expires) slot->softExpires = slot->expires;
+                    isRefreshed = 1;
+                }
+            break;
+        }
+    OTDiskCacheUnlock (cache);
+    free (key);
+    if (!body) return 0;
+
+    /* Without an entity-tag a stale record can only serve as an offline fallback. */
+    if (!isStale || entityTag || session->offlineFallback) tree = OTJsonParse (body);
+    free (body);
+    if (!tree)
+        {
+            free (entityTag);
+            return 0;
+        }
+    if (isStale)
+        {
+            http->staleTree = tree;
+            http->staleEntityTag = entityTag;
+            return 0;
+        }
+    if (isRefreshed)
+        OTCacheRefreshStart (session, http, tree, entityTag ? strdup (entityTag) : NULL);
+    http->tree = tree;
+    if (session->verboseMode) fprintf (stderr, "* Disk cache hit %s\n", http->endpoint);
+    http->httpOk = 0;
+    http->responseCode = 200;
+    http->isStreamParsed = 1;
+    http->entityTag = entityTag;
+    return 1;
+}
+
+/* Renew the expiry of a record revalidated with 304 Not Modified. Must be called with the
+ * lock held. */
+static void
+OTDiskCacheRenew (struct OTDiskCacheContainer *const cache, const char *const key,
+                  const uint64_t hash, const struct OTDiskCacheRecord *const renewed)
+{
+    struct OTDiskCacheRecord record;
+    struct OTDiskCacheSlot *slot = NULL;
+    uint64_t mask = cache->header->slots - 1;
+    uint64_t i;
+    for (i = 0; i < OTDISKCACHE_PROBES; i++)
+        {
+            slot = &cache->slots[(hash + i) & mask];
+            if (!slot->offset) return;
+            if (slot->hash != hash) continue;
+            if (OTDiskCacheMatch (cache, slot, key, &record) != 0) return;
+            slot->softExpires = renewed->softExpires;
+            slot->expires = renewed->expires;
+            return;
+        }
+}
+
+/* Append a successful response to the segment and index it. */
+void
+OTDiskCacheStore (const struct OTSessionContainer *const session,
+                  const struct OTHttpContainer *const http)
+{
+    struct OTDiskCacheContainer *cache = (struct OTDiskCacheContainer *)session->diskCache;
+    struct OTDiskCacheRecord record;
+    struct OTDiskCacheSlot *slot = NULL;
+    struct OTDiskCacheSlot *victim = NULL;
+    unsigned long unused;
+    uint64_t hash;
+    uint64_t mask;
+    uint64_t size;
+    uint64_t i;
+    char *key = NULL;
+    long long ttl;
+    long long hardTTL;
+
+    if (!cache || !http->isCacheable || http->httpOk != 0 || http->responseCode != 200
+        || http->isOffline || !http->endpoint)
+        return;
+    if (!http->isRevalidated && !http->response) return;
+    ttl = OTCacheTTL (session, http->endpoint, &hardTTL);
+    if (!ttl) return;
+    key = OTCacheKey (session, http, &unused);
+    if (!key) return;
+    hash = OTDiskCacheHash (key);
+
+    record.magic = OTDISKCACHE_MAGIC;
+    record.keyLength = strlen (key);
+    record.entityTagLength = http->entityTag ? strlen (http->entityTag) : 0;
+    record.bodyLength = http->responseBytes;
+    record.softExpires = time (NULL) + ttl / 1000;
+    record.expires = record.softExpires - ttl / 1000 + hardTTL / 1000;
+    size = sizeof (record) + record.keyLength + record.entityTagLength + record.bodyLength;
+
+    if (OTDiskCacheLock (cache) != 0)
+        {
+            free (key);
+            return;
+        }
+    /* The body of a revalidated response was not transferred. */
+    if (http->isRevalidated)
+        {
+            OTDiskCacheRenew (cache, key, hash, &record);
+            goto end;
+        }
+    if (size > cache->capacity) goto end;
+    if (cache->end + size > cache->capacity && OTDiskCacheCompact (cache, size) != 0) goto end;
+    if (pwrite (cache->segment, &record, sizeof (record), cache->end) != sizeof (record)
+        || pwrite (cache->segment, key, record.keyLength, cache->end + sizeof (record))
+               != (ssize_t)record.keyLength
+        || pwrite (cache->segment, http->entityTag, record.entityTagLength,
+                   cache->end + sizeof (record) + record.keyLength)
+               != (ssize_t)record.entityTagLength
+        || pwrite (cache->segment, http->response, record.bodyLength,
+                   cache->end + sizeof (record) + record.keyLength + record.entityTagLength)
+               != (ssize_t)record.bodyLength)
+        goto end;
+
+    /* Replace the slot of the key, an empty one or the one expiring first. */
+    mask = cache->header->slots - 1;
+    for (i = 0; i < OTDISKCACHE_PROBES; i++)
+        {
+            slot = &cache->slots[(hash + i) & mask];
+            if (!slot->offset || slot->hash == hash)
+                {
+                    victim = slot;
+                    break;
+                }
+            if (!victim || slot->expires < victim->expires) victim = slot;
+        }
+    victim->hash = hash;
+    victim->offset = cache->end;
+    victim->softExpires = record.softExpires;
+    victim->expires = record.expires;
+    cache->end += size;
+end:
+    OTDiskCacheUnlock (cache);
+    free (key);
+}
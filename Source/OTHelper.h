@@ -28,6 +28,28 @@
 int OTConcatenateString (char **str, char *format, ...) __attribute__ ((format (printf, 2, 3)));
 int OTArrayToString (char **str, const char **array, const int length);
 char *OTUrlEncode (char *str);
+
+/* Url builder (See OTUrlEncode.c). The string is written into the storage of the caller,
+ * usually on the stack, and only moved to the heap if it outgrows it. Errors are sticky,
+ * OTUrlString returns NULL after one. */
+#define OTURL_STORAGE 256
+struct OTUrlBuffer
+{
+    char *data;
+    char *storage;
+    size_t storageCapacity;
+    size_t size;
+    size_t capacity;
+    int isFailed;
+};
+void OTUrlInit (struct OTUrlBuffer *const buffer, char *storage, const size_t capacity);
+void OTUrlReset (struct OTUrlBuffer *const buffer);
+void OTUrlFree (struct OTUrlBuffer *const buffer);
+void OTUrlAppend (struct OTUrlBuffer *const buffer, const char *const string);
+void OTUrlAppendEncoded (struct OTUrlBuffer *const buffer, const char *string);
+void OTUrlAppendInteger (struct OTUrlBuffer *const buffer, const long long value);
+void OTUrlExpand (struct OTUrlBuffer *const buffer, const char *format, ...);
+char *OTUrlString (struct OTUrlBuffer *const buffer);
 char *OTStringDecodeBase64 (const char *const enc);
 
 void *OTAllocContainer (enum OTTypes type);
@@ -24,32 +24,178 @@
  */
 
 #include <curl/curl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
 #include "OTHelper.h"
 #include "OTHttp.h"
 #include "openTIDAL.h"
 
-/* libcurl callback and writedata structure. */
-struct OTHttpMemory
+/* Number of learned response sizes. Endpoints are mapped to a slot by their family. */
+#define OTHTTP_SIZE_HINTS 64
+/* Connect timeout in milliseconds and the seconds without a received byte after which a
+ * transfer is aborted. */
+#define OTHTTP_CONNECT_TIMEOUT 10000
+#define OTHTTP_STALL_TIME 30
+
+/* Session-level counters and learned response sizes. */
+struct OTHttpMetrics
 {
-    char *memory;
-    size_t size;
+    atomic_ulong responses;
+    atomic_ulong responseBytes;
+    atomic_ulong wireBytes;
+    atomic_ulong reallocations;
+    atomic_ulong avoidedRequests;
+    atomic_ulong negativeEntries;
+    atomic_ulong throttledRequests;
+    atomic_ulong throttleWait;
+    atomic_size_t sizeHints[OTHTTP_SIZE_HINTS];
 };
 
+void *
+OTHttpMetricsCreate (void)
+{
+    struct OTHttpMetrics *ptr = NULL;
+    int i;
+    ptr = malloc (sizeof (struct OTHttpMetrics));
+    if (!ptr) return NULL;
+    atomic_init (&ptr->responses, 0);
+    atomic_init (&ptr->responseBytes, 0);
+    atomic_init (&ptr->wireBytes, 0);
+    atomic_init (&ptr->reallocations, 0);
+    atomic_init (&ptr->avoidedRequests, 0);
+    atomic_init (&ptr->negativeEntries, 0);
+    atomic_init (&ptr->throttledRequests, 0);
+    atomic_init (&ptr->throttleWait, 0);
+    for (i = 0; i < OTHTTP_SIZE_HINTS; i++)
+        atomic_init (&ptr->sizeHints[i], 0);
+    return ptr;
+}
+
+void
+OTHttpMetricsCleanup (void *metrics)
+{
+    free (metrics);
+}
+
+void
+OTSessionStatistics (const struct OTSessionContainer *const session,
+                     struct OTStatisticsContainer *const statistics)
+{
+    struct OTHttpMetrics *ptr = (struct OTHttpMetrics *)session->httpMetrics;
+    memset (statistics, 0, sizeof (struct OTStatisticsContainer));
+    if (!ptr) return;
+    statistics->responses = atomic_load_explicit (&ptr->responses, memory_order_relaxed);
+    statistics->responseBytes = atomic_load_explicit (&ptr->responseBytes, memory_order_relaxed);
+    statistics->wireBytes = atomic_load_explicit (&ptr->wireBytes, memory_order_relaxed);
+    statistics->reallocations = atomic_load_explicit (&ptr->reallocations, memory_order_relaxed);
+    statistics->avoidedRequests
+        = atomic_load_explicit (&ptr->avoidedRequests, memory_order_relaxed);
+    statistics->negativeEntries
+        = atomic_load_explicit (&ptr->negativeEntries, memory_order_relaxed);
+    statistics->throttledRequests
+        = atomic_load_explicit (&ptr->throttledRequests, memory_order_relaxed);
+    statistics->throttleWait = atomic_load_explicit (&ptr->throttleWait, memory_order_relaxed);
+}
+
+/* Count a request answered by the negative cache or a missing artefact remembered by it. */
+void
+OTHttpMetricsNegative (const struct OTSessionContainer *const session, const int isHit)
+{
+    struct OTHttpMetrics *ptr = (struct OTHttpMetrics *)session->httpMetrics;
+    if (!ptr) return;
+    if (isHit)
+        atomic_fetch_add_explicit (&ptr->avoidedRequests, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit (&ptr->negativeEntries, 1, memory_order_relaxed);
+}
+
+/* Count a request delayed by the rate limit and its wait in milliseconds. */
+void
+OTHttpMetricsThrottle (const struct OTSessionContainer *const session, const long wait)
+{
+    struct OTHttpMetrics *ptr = (struct OTHttpMetrics *)session->httpMetrics;
+    if (!ptr) return;
+    atomic_fetch_add_explicit (&ptr->throttledRequests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&ptr->throttleWait, (unsigned long)wait, memory_order_relaxed);
+}
+
+/* Map an endpoint to its size hint slot. Path segments containing a digit are ids and
+ * skipped, so "/v1/albums/1/items" and "/v1/albums/2/items" share one slot. */
+static atomic_size_t *
+OTHttpSizeHint (const struct OTSessionContainer *const session, const char *endpoint)
+{
+    struct OTHttpMetrics *ptr = (struct OTHttpMetrics *)session->httpMetrics;
+    unsigned long hash = 5381;
+    const char *segment = NULL;
+    const char *c = NULL;
+    int isId;
+    if (!ptr || !endpoint) return NULL;
+
+    segment = endpoint;
+    while (*segment)
+        {
+            isId = 0;
+            for (c = segment; *c && *c != '/'; c++)
+                if (*c >= '0' && *c <= '9') isId = 1;
+            if (!isId)
+                for (c = segment; *c && *c != '/'; c++)
+                    hash = hash * 33 + (unsigned char)*c;
+            hash = hash * 33 + '/';
+            segment = *c ? c + 1 : c;
+        }
+    return &ptr->sizeHints[hash % OTHTTP_SIZE_HINTS];
+}
+
+/* Grow the buffer to capacity. Counts every reallocation. */
+static int
+OTHttpMemoryReserve (struct OTHttpMemory *const mem, const size_t capacity)
+{
+    char *ptr = NULL;
+    if (capacity <= mem->capacity) return 0;
+    ptr = realloc (mem->memory, capacity);
+    if (!ptr) return -1;
+    mem->memory = ptr;
+    mem->capacity = capacity;
+    mem->reallocations += 1;
+    return 0;
+}
+
 /* libcurl callback */
 static size_t
 OTHttpCallbackFunction (void *data, size_t size, size_t nmemb, void *userp)
 {
     size_t realsize = size * nmemb;
+    size_t capacity;
     struct OTHttpMemory *mem = (struct OTHttpMemory *)userp;
 
-    char *ptr = realloc (mem->memory, mem->size + realsize + 1);
-    if (ptr == NULL) return 0;
+    /* Parse the chunk directly. A parse error is reported by OTJsonStreamFinish, the
+     * transfer itself is not aborted. */
+    if (mem->stream)
+        {
+            OTJsonStreamFeed (mem->stream, data, realsize);
+            if (!mem->isBodyKept)
+                {
+                    mem->size += realsize;
+                    return realsize;
+                }
+        }
+
+    if (mem->size + realsize + 1 > mem->capacity)
+        {
+            /* Geometric growth. The first allocation is seeded by the learned size. */
+            capacity = mem->capacity * 2;
+            if (mem->capacity == 0 && mem->sizeHint) capacity = mem->sizeHint + 1;
+            if (capacity < mem->size + realsize + 1) capacity = mem->size + realsize + 1;
+            if (OTHttpMemoryReserve (mem, capacity) != 0) return 0;
+        }
 
-    mem->memory = ptr;
     memcpy (&(mem->memory[mem->size]), data, realsize);
     mem->size += realsize;
     mem->memory[mem->size] = 0;
@@ -57,6 +203,85 @@ OTHttpCallbackFunction (void *data, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
+/* Copy the value of a captured header. */
+static void
+OTHttpHeaderString (char **target, const char *value, const size_t length)
+{
+    char *ptr = NULL;
+    if (length == 0) return;
+    ptr = malloc (length + 1);
+    if (!ptr) return;
+    memcpy (ptr, value, length);
+    ptr[length] = '\0';
+    free (*target);
+    *target = ptr;
+}
+
+/* libcurl header callback. Captures the requested headers and preallocates the response
+ * buffer with the Content-Length. Headers of an earlier response of the transfer (100
+ * Continue) are replaced. */
+static size_t
+OTHttpHeaderFunction (char *data, size_t size, size_t nmemb, void *userp)
+{
+    size_t realsize = size * nmemb;
+    struct OTHttpMemory *mem = (struct OTHttpMemory *)userp;
+    struct OTHeaderContainer *headers = &mem->headers;
+    const char *value = NULL;
+    size_t length = 0;
+    unsigned long long number = 0;
+    unsigned int header;
+    size_t i = 0;
+
+    if (realsize > 5 && strncmp (data, "HTTP/", 5) == 0)
+        {
+            OTHttpHeadersClear (headers);
+            return realsize;
+        }
+    header = OTHttpParseHeader (data, realsize, &value, &length);
+    if (header == HEADER_CONTENT_LENGTH || header == HEADER_RETRY_AFTER)
+        for (i = 0; i < length && value[i] >= '0' && value[i] <= '9'; i++)
+            number = number * 10 + (value[i] - '0');
+    switch (header)
+        {
+        case HEADER_ENTITY_TAG:
+            if (mem->headerMask & HEADER_ENTITY_TAG)
+                OTHttpHeaderString (&headers->entityTag, value, length);
+            break;
+        case HEADER_CACHE_CONTROL:
+            if (mem->headerMask & HEADER_CACHE_CONTROL)
+                OTHttpHeaderString (&headers->cacheControl, value, length);
+            break;
+        case HEADER_RETRY_AFTER:
+            if (!(mem->headerMask & HEADER_RETRY_AFTER) || length == 0) break;
+            if (i == length)
+                headers->retryAfter = (long)number;
+            else if (length < 64)
+                {
+                    /* HTTP-date. */
+                    char date[64];
+                    time_t when;
+                    memcpy (date, value, length);
+                    date[length] = '\0';
+                    when = curl_getdate (date, NULL);
+                    if (when >= 0)
+                        headers->retryAfter = when > time (NULL) ? when - time (NULL) : 0;
+                }
+            break;
+        case HEADER_CONTENT_LENGTH:
+            if (length == 0 || i != length) break;
+            if (mem->headerMask & HEADER_CONTENT_LENGTH) headers->contentLength = number;
+            if (mem->isDummy || (mem->stream && !mem->isBodyKept)) break;
+            /* The Content-Length of an encoded body is smaller than the decoded body,
+             * prefer the learned size if it is larger. */
+            if (number < mem->sizeHint) number = mem->sizeHint;
+            /* Ignore implausible values, the buffer grows geometrically anyway. */
+            if (number > 0 && number < 64 * 1024 * 1024)
+                OTHttpMemoryReserve (mem, mem->size + number + 1);
+            break;
+        }
+    return realsize;
+}
+
 /* libcurl callback dummy skips the reallocation process. */
 static size_t
 OTHttpCallBackDummyFunction (void *data, size_t size, size_t nmemb, void *userp)
@@ -64,18 +289,149 @@ OTHttpCallBackDummyFunction (void *data, size_t size, size_t nmemb, void *userp)
     return size * nmemb;
 }
 
+/* Session-level share object. All handles used with a session share one connection cache,
+ * DNS cache and TLS session cache. */
+struct OTHttpShare
+{
+    CURLSH *share;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+};
+
+static void
+OTHttpShareLock (CURL *handle, curl_lock_data data, curl_lock_access access, void *userp)
+{
+    struct OTHttpShare *ptr = (struct OTHttpShare *)userp;
+    pthread_mutex_lock (&ptr->locks[data]);
+}
+
+static void
+OTHttpShareUnlock (CURL *handle, curl_lock_data data, void *userp)
+{
+    struct OTHttpShare *ptr = (struct OTHttpShare *)userp;
+    pthread_mutex_unlock (&ptr->locks[data]);
+}
+
+void *
+OTHttpShareCreate (void)
+{
+    struct OTHttpShare *ptr = NULL;
+    int i;
+    ptr = malloc (sizeof (struct OTHttpShare));
+    if (!ptr) return NULL;
+    ptr->share = curl_share_init ();
+    if (!ptr->share)
+        {
+            free (ptr);
+            return NULL;
+        }
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_init (&ptr->locks[i], NULL);
+    curl_share_setopt (ptr->share, CURLSHOPT_LOCKFUNC, OTHttpShareLock);
+    curl_share_setopt (ptr->share, CURLSHOPT_UNLOCKFUNC, OTHttpShareUnlock);
+    curl_share_setopt (ptr->share, CURLSHOPT_USERDATA, ptr);
+    curl_share_setopt (ptr->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt (ptr->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt (ptr->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    return ptr;
+}
+
+/* All handles attached to the share object must be cleaned up before. Returns 0 on
+ * success and -1 if a handle is still attached. The share object is then left alive, so
+ * the remaining handles stay usable, and its memory is not released. */
+int
+OTHttpShareCleanup (void *share)
+{
+    struct OTHttpShare *ptr = (struct OTHttpShare *)share;
+    int i;
+    if (!ptr) return 0;
+    if (curl_share_cleanup (ptr->share) != CURLSHE_OK) return -1;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+        pthread_mutex_destroy (&ptr->locks[i]);
+    free (ptr);
+    return 0;
+}
+
+/* Attach a handle to the share object of the session. */
+void
+OTHttpShareAttach (const struct OTSessionContainer *const session,
+                   struct OTHttpHandle *const handle)
+{
+    struct OTHttpShare *ptr = (struct OTHttpShare *)session->httpShare;
+    if (handle->share == ptr) return;
+    if (curl_easy_setopt (handle->curl, CURLOPT_SHARE, ptr ? ptr->share : NULL) == CURLE_OK)
+        handle->share = ptr;
+    OTHttpTicketsAttach (session, handle->curl);
+}
+
 void *
 OTHttpThreadHandleCreate (void)
 {
-    void *handle = NULL;
-    handle = curl_easy_init ();
+    struct OTHttpHandle *handle = NULL;
+    handle = malloc (sizeof (struct OTHttpHandle));
+    if (!handle) return NULL;
+    handle->curl = curl_easy_init ();
+    if (!handle->curl)
+        {
+            free (handle);
+            return NULL;
+        }
+    handle->asyncRequest = NULL;
+    handle->share = NULL;
+    handle->memchunk.memory = NULL;
+    handle->memchunk.size = 0;
+    handle->memchunk.capacity = 0;
+    handle->memchunk.reallocations = 0;
+    handle->memchunk.sizeHint = 0;
+    handle->memchunk.isDummy = 0;
+    handle->memchunk.stream = NULL;
+    handle->memchunk.isBodyKept = 0;
+    handle->memchunk.headerMask = 0;
+    OTHttpHeadersInit (&handle->memchunk.headers);
+    handle->sizeHint = NULL;
+    handle->chunk = NULL;
+    handle->token = NULL;
+    OTUrlInit (&handle->url, NULL, 0);
+    handle->profile.isApplied = 0;
+    handle->profile.verboseMode = 0;
+    handle->profile.multiplexStreams = 0;
+    handle->profile.isDummy = -1;
+    handle->profile.isAuthRequest = -1;
+    handle->profile.type = -1;
+    handle->profile.headers = NULL;
+    handle->attempts = 0;
+    handle->isReplayed = 0;
+    handle->deadline = 0;
+    handle->callDeadline = 0;
+    handle->cancel = NULL;
+    handle->isOverBudget = 0;
+    handle->headerMask = 0;
+    handle->seed = (unsigned int)time (NULL) ^ (unsigned int)(uintptr_t)handle;
     return handle;
 }
 
 void
 OTHttpThreadHandleCleanup (void *handle)
 {
-    curl_easy_cleanup ((CURL *)handle);
+    struct OTHttpHandle *ptr = (struct OTHttpHandle *)handle;
+    if (ptr)
+        {
+            curl_easy_cleanup (ptr->curl);
+            curl_slist_free_all (ptr->chunk);
+            OTHttpTokenRelease (ptr->token);
+            free (ptr->memchunk.memory);
+            OTJsonStreamDelete (ptr->memchunk.stream);
+            OTHttpHeadersClear (&ptr->memchunk.headers);
+            OTUrlFree (&ptr->url);
+            free (ptr);
+        }
+}
+
+/* Select the response headers captured for the requests of a handle. */
+void
+OTHttpThreadHandleHeaders (void *threadHandle, const unsigned int headers)
+{
+    struct OTHttpHandle *handle = (struct OTHttpHandle *)threadHandle;
+    if (handle) handle->headerMask = headers;
 }
 
 /* Initialise OTHttpContainer structure. */
@@ -86,173 +442,440 @@ OTHttpContainerInit (struct OTHttpContainer *const http)
     http->httpOk = -1;
     http->isAuthRequest = 0;
     http->isDummy = 0;
+    http->isStreamParsed = 0;
+    http->isCacheable = 0;
+    http->isPrivate = 0;
+    http->isArtefact = 0;
+    http->isRejected = 0;
+    http->isCancelled = 0;
+    http->isDeadlineExceeded = 0;
     http->responseCode = 0;
+    http->responseBytes = 0;
+    http->wireBytes = 0;
     http->entityTagHeader = NULL;
     http->response = NULL;
+    http->tree = NULL;
+    http->headerMask = 0;
+    http->entityTag = NULL;
+    OTHttpHeadersInit (&http->headers);
+    http->staleTree = NULL;
+    http->staleEntityTag = NULL;
+    http->isRevalidated = 0;
+    http->isOffline = 0;
     http->endpoint = NULL;
     http->parameter = NULL;
     http->postData = NULL;
 }
 
-/* Concatenate libcurl http header ASCII String. */
+/* Build the url into the reusable buffer of the handle. */
 static char *
-OTHttpAuthHeader (const struct OTSessionContainer *const session,
-                  struct OTHttpContainer *const http)
+OTHttpUrl (const struct OTSessionContainer *const session, struct OTHttpContainer *const http)
 {
-    char *string = NULL;
-    if (!session->restrictedMode)
+    struct OTUrlBuffer *url = &http->handle->url;
+    if (!http->endpoint) return NULL;
+    OTUrlReset (url);
+    OTUrlAppend (url, http->isAuthRequest ? session->authUrl : session->baseUrl);
+    OTUrlAppend (url, http->endpoint);
+    if (http->parameter)
         {
-            if (session->accessToken)
-                OTConcatenateString (&string, "Authorization: Bearer %s", session->accessToken);
+            OTUrlAppend (url, "?");
+            OTUrlAppend (url, http->parameter);
         }
-    else
-        OTConcatenateString (&string, "X-Tidal-Token: %s", session->clientId);
-    return string;
+    return OTUrlString (url);
 }
 
-/* Concatenate url ASCII String. */
-static char *
-OTHttpUrl (const struct OTSessionContainer *const session, struct OTHttpContainer *const http)
+/* Release the per-transfer state of a handle. The response buffer is not freed, its
+ * ownership is transferred to the OTHttpContainer in OTHttpFinish. */
+static void
+OTHttpHandleReset (struct OTHttpHandle *const handle)
 {
-    char *string = NULL;
-    char *base = NULL;
-    if (http->endpoint)
+    curl_slist_free_all (handle->chunk);
+    OTJsonStreamDelete (handle->memchunk.stream);
+    OTHttpHeadersClear (&handle->memchunk.headers);
+    handle->chunk = NULL;
+    handle->sizeHint = NULL;
+    handle->memchunk.memory = NULL;
+    handle->memchunk.size = 0;
+    handle->memchunk.capacity = 0;
+    handle->memchunk.reallocations = 0;
+    handle->memchunk.sizeHint = 0;
+    handle->memchunk.isDummy = 0;
+    handle->memchunk.stream = NULL;
+    handle->memchunk.isBodyKept = 0;
+    handle->memchunk.headerMask = 0;
+}
+
+/* Discard a partial response before a transfer is repeated. */
+void
+OTHttpDiscardResponse (struct OTHttpHandle *const handle)
+{
+    struct OTHttpMemory *mem = &handle->memchunk;
+    free (mem->memory);
+    mem->memory = NULL;
+    mem->size = 0;
+    mem->capacity = 0;
+    OTHttpHeadersClear (&mem->headers);
+    if (mem->stream)
         {
-            if (!http->isAuthRequest)
-                base = session->baseUrl;
-            else
-                base = session->authUrl;
+            OTJsonStreamDelete (mem->stream);
+            mem->stream = OTJsonStreamCreate ();
+        }
+}
 
-            if (http->parameter)
-                OTConcatenateString (&string, "%s%s?%s", base, http->endpoint, http->parameter);
+/* Status of a request that did not return a response. */
+enum OTStatus
+OTHttpTransportStatus (const struct OTHttpContainer *const http)
+{
+    if (http->isRejected) return SERVICE_UNAVAILABLE;
+    if (http->isCancelled) return CANCELLED;
+    if (http->isDeadlineExceeded) return DEADLINE_EXCEEDED;
+    return CURL_NOT_OK;
+}
+
+/* Apply the options that do not change between requests. Request specific options are
+ * only set if they differ from the previous request performed with the handle. */
+static void
+OTHttpHandleProfile (const struct OTSessionContainer *const session,
+                     struct OTHttpHandle *const handle, const struct OTHttpContainer *const http)
+{
+    struct OTHttpProfile *profile = &handle->profile;
+    CURL *curl = handle->curl;
+
+    if (!profile->isApplied)
+        {
+            /* Signals are not thread-safe. */
+            curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt (curl, CURLOPT_WRITEDATA, &handle->memchunk);
+            curl_easy_setopt (curl, CURLOPT_HEADERDATA, &handle->memchunk);
+            curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, OTHttpHeaderFunction);
+            /* Negotiate every content encoding libcurl was built with. The body is
+             * decoded before it reaches the write callback. */
+            curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "");
+            /* Give up on connections that do not connect or stall. The timeouts are
+             * retried like other transport errors. */
+            curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT_MS, (long)OTHTTP_CONNECT_TIMEOUT);
+            curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+            curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, (long)OTHTTP_STALL_TIME);
+            profile->isApplied = 1;
+        }
+    if (profile->verboseMode != session->verboseMode)
+        {
+            curl_easy_setopt (curl, CURLOPT_VERBOSE, session->verboseMode ? 1L : 0L);
+            profile->verboseMode = session->verboseMode;
+        }
+    /* Negotiate HTTP/2 and prefer waiting for a multiplexed stream over a new connection. */
+    if ((profile->multiplexStreams > 0) != (session->multiplexStreams > 0))
+        {
+            if (session->multiplexStreams)
+                {
+                    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+                    curl_easy_setopt (curl, CURLOPT_PIPEWAIT, 1L);
+                }
+            else
+                {
+                    curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_NONE);
+                    curl_easy_setopt (curl, CURLOPT_PIPEWAIT, 0L);
+                }
+        }
+    profile->multiplexStreams = session->multiplexStreams;
+    if (profile->isDummy != http->isDummy || profile->type != *http->type)
+        {
+            /* Standard WriteFunction/Data callback. */
+            if (!http->isDummy && *http->type != HEAD)
+                curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, OTHttpCallbackFunction);
             else
-                OTConcatenateString (&string, "%s%s", base, http->endpoint);
+                curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, OTHttpCallBackDummyFunction);
+            profile->isDummy = http->isDummy;
+        }
+    if (profile->type != *http->type)
+        {
+            curl_easy_setopt (curl, CURLOPT_NOBODY, 0L);
+            curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, NULL);
+            /* Set request specific options. */
+            switch (*http->type)
+                {
+                case GET:
+                    curl_easy_setopt (curl, CURLOPT_HTTPGET, 1L);
+                    break;
+                case POST:
+                    curl_easy_setopt (curl, CURLOPT_POST, 1L);
+                    break;
+                case DELETE:
+                    curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+                    break;
+                case PUT:
+                    curl_easy_setopt (curl, CURLOPT_CUSTOMREQUEST, "PUT");
+                    break;
+                case HEAD:
+                    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+                    break;
+                }
+            profile->type = *http->type;
+        }
+    /* clientId & clientSecret authorisation. */
+    if (profile->isAuthRequest != http->isAuthRequest)
+        {
+            if (http->isAuthRequest)
+                {
+                    curl_easy_setopt (curl, CURLOPT_HTTPHEADER, NULL);
+                    profile->headers = NULL;
+                    curl_easy_setopt (curl, CURLOPT_USERNAME, session->clientId);
+                    curl_easy_setopt (curl, CURLOPT_PASSWORD, session->clientSecret);
+                }
+            else
+                {
+                    curl_easy_setopt (curl, CURLOPT_USERNAME, NULL);
+                    curl_easy_setopt (curl, CURLOPT_PASSWORD, NULL);
+                }
+            profile->isAuthRequest = http->isAuthRequest;
         }
-    return string;
 }
 
-/* Perform a HTTP(s) request using the libcurl easy api. Configure values with the OTHttpContainer.
- * If successful returns an allocated response. Needs to be deallocated after use!
- */
-void
-OTHttpRequest (struct OTSessionContainer *const session, struct OTHttpContainer *const http)
+/* Configure the libcurl easy handle for the request described by the OTHttpContainer.
+ * Returns 0 if the handle is ready to be performed (by curl_easy_perform or a multi handle).
+ * Every successful call must be followed by OTHttpFinish. */
+int
+OTHttpPrepare (struct OTSessionContainer *const session, struct OTHttpContainer *const http)
 {
-    /* libcurl header list. */
-    struct curl_slist *chunk = NULL;
-    struct OTHttpMemory memchunk;
-    memchunk.memory = NULL;
-    memchunk.size = 0;
-    char *url = NULL;
-    char *authHeader = NULL;
-    int isHeadRequest = 0;
+    struct OTHttpHandle *handle = http->handle;
+    const struct curl_slist *headers = NULL;
+    const struct curl_slist *item = NULL;
+    const char *postData = http->postData;
+    CURLcode res;
 
     if (!session->clientId)
         {
             if (session->verboseMode)
                 fprintf (stderr, "* ClientId or ClientSecret ASCII string is not allocated.");
-            goto end;
+            return -1;
         }
 
     if (session->verboseMode) fprintf (stderr, "* Check if HTTP-HANDLE is initialised...");
     /* Check if allocation of handle failed */
-    if (!http->handle) goto end;
-    CURLcode res;
+    if (!handle) return -1;
     if (session->verboseMode) fprintf (stderr, "OK\n");
+    /* Do not start a request that is cancelled or past its deadline. */
+    res = OTHttpBudget (handle, 0);
+    if (res != CURLE_OK)
+        {
+            OTHttpBudgetResult (http, res);
+            return -1;
+        }
 
-    /* Check if handle is the mainHttpHandle.
-     * Only the mainHttpHandle should perform oAuth refresh requests to
-     * prevent multiple calls. */
-    if (session->mainHttpHandle == http->handle && !http->isAuthRequest)
+    /* Every handle checks the token of the session. The first one that sees it expiring
+     * refreshes it, the others keep using the current token. With a background refresher
+     * the token is renewed by its thread unless it already expired. Asynchronous request
+     * handles always leave the renewal to the refresher, an expired token waits in the
+     * engine (See OTAsyncSubmit). The snapshot stays referenced by the handle until its
+     * next request. */
+    if (!http->isAuthRequest)
         {
-            /* Do TIDAL Session refresh check. */
-            if (session->verboseMode >= 1)
-                fprintf (stderr, "* Check for expired OAuth2 accessToken timestamp...\n");
-            OTSessionRefresh (session);
+            OTHttpTokenRelease (handle->token);
+            handle->token = OTHttpTokenAcquire (session);
+            if (handle->token && OTHttpTokenIsExpiring (handle->token) && handle->asyncRequest)
+                OTSessionRenewInBackground (session);
+            else if (handle->token && OTHttpTokenIsExpiring (handle->token)
+                     && (OTHttpTokenIsExpired (handle->token)
+                         || OTSessionRefresherWake (session) != 0))
+                {
+                    if (session->verboseMode >= 1)
+                        fprintf (stderr, "* Check for expired OAuth2 accessToken timestamp...\n");
+                    OTSessionRefresh (session);
+                    OTHttpTokenRelease (handle->token);
+                    handle->token = OTHttpTokenAcquire (session);
+                }
+        }
+    /* Fail fast while the upstream is unhealthy. */
+    if (OTHttpBreakerAllow (session, http) != 0)
+        {
+            if (session->verboseMode) fprintf (stderr, "* Circuit breaker is open\n");
+            http->isRejected = 1;
+            return -1;
+        }
+    handle->attempts = 0;
+    handle->isReplayed = 0;
+    handle->deadline = OTHttpTime () + session->retryDeadline;
+    if (handle->callDeadline && handle->callDeadline < handle->deadline)
+        handle->deadline = handle->callDeadline;
+    /* Handles are created without a session. Attach them on first use. */
+    OTHttpShareAttach (session, handle);
+    /* Concatenate Url & lookup the cached AuthHeader. */
+    OTHttpHandleReset (handle);
+    if (!OTHttpUrl (session, http)) goto error;
+    if (http->isAuthRequest && !session->clientSecret) goto error;
+    if (!http->isAuthRequest)
+        {
+            if (!handle->token) goto error;
+            headers = handle->token->list;
+        }
+    /* A HEAD response has no body, only its headers are captured. */
+    handle->memchunk.isDummy = http->isDummy || *http->type == HEAD;
+    handle->memchunk.headerMask = handle->headerMask | http->headerMask;
+    if (http->isCacheable) handle->memchunk.headerMask |= HEADER_ENTITY_TAG;
+    handle->memchunk.isBodyKept = http->isCacheable && session->diskCache;
+    if (http->isStreamParsed && !http->isDummy && *http->type != HEAD)
+        {
+            handle->memchunk.stream = OTJsonStreamCreate ();
+            if (!handle->memchunk.stream) goto error;
+        }
+    /* The buffer is allocated by the header or write callback. */
+    if (!handle->memchunk.isDummy && (!handle->memchunk.stream || handle->memchunk.isBodyKept))
+        {
+            handle->sizeHint = OTHttpSizeHint (session, http->endpoint);
+            if (handle->sizeHint)
+                handle->memchunk.sizeHint
+                    = atomic_load_explicit (handle->sizeHint, memory_order_relaxed);
         }
-    /* Concatenate Url & AuthHeader. */
-    url = OTHttpUrl (session, http);
-    authHeader = OTHttpAuthHeader (session, http);
-    if (!url || !authHeader) goto end;
-    if (!http->isDummy) /* Allocate memory buffer to grow it later. */
-        memchunk.memory = malloc (1);
     /* libcurl doesn't like NULL */
-    if (!http->postData) http->postData = "";
+    if (!postData) postData = "";
 
     if (session->verboseMode) fprintf (stderr, "* Begin CURLOPT configuration...\n");
 
     /* Begin curl_easy_opt configuration. */
-    curl_easy_setopt (http->handle, CURLOPT_URL, url);
-    curl_easy_setopt (http->handle, CURLOPT_NOBODY, 0L);
-    curl_easy_setopt (http->handle, CURLOPT_HEADERFUNCTION, NULL);
-    curl_easy_setopt (http->handle, CURLOPT_HEADERDATA, NULL);
-    curl_easy_setopt (http->handle, CURLOPT_CUSTOMREQUEST, NULL);
-    /* Set request specific options. */
-    switch (*http->type)
+    OTHttpHandleProfile (session, handle, http);
+    curl_easy_setopt (handle->curl, CURLOPT_URL, handle->url.data);
+    if (*http->type == POST || *http->type == DELETE || *http->type == PUT)
+        curl_easy_setopt (handle->curl, CURLOPT_POSTFIELDS, postData);
+
+    if (!http->isAuthRequest)
         {
-        case GET:
-            curl_easy_setopt (http->handle, CURLOPT_HTTPGET, 1L);
-            break;
-        case POST:
-            curl_easy_setopt (http->handle, CURLOPT_HTTPPOST, 1L);
-            curl_easy_setopt (http->handle, CURLOPT_POSTFIELDS, http->postData);
-            break;
-        case DELETE:
-            curl_easy_setopt (http->handle, CURLOPT_CUSTOMREQUEST, "DELETE");
-            curl_easy_setopt (http->handle, CURLOPT_POSTFIELDS, http->postData);
-            break;
-        case PUT:
-            curl_easy_setopt (http->handle, CURLOPT_CUSTOMREQUEST, "PUT");
-            curl_easy_setopt (http->handle, CURLOPT_POSTFIELDS, http->postData);
-            break;
-        case HEAD:
-            curl_easy_setopt (http->handle, CURLOPT_NOBODY, 1L);
-            curl_easy_setopt (http->handle, CURLOPT_HEADERFUNCTION, OTHttpCallbackFunction);
-            curl_easy_setopt (http->handle, CURLOPT_HEADERDATA, &memchunk);
-            isHeadRequest = 1;
-            break;
+            /* Requests with additional headers need their own list. */
+            if (http->entityTagHeader || http->staleEntityTag)
+                {
+                    for (item = headers; item; item = item->next)
+                        {
+                            handle->chunk = curl_slist_append (handle->chunk, item->data);
+                            if (!handle->chunk) goto error;
+                        }
+                    if (http->entityTagHeader)
+                        handle->chunk = curl_slist_append (handle->chunk, http->entityTagHeader);
+                    else
+                        {
+                            char *header = NULL;
+                            OTConcatenateString (&header, "If-None-Match: %s",
+                                                 http->staleEntityTag);
+                            if (!header) goto error;
+                            handle->chunk = curl_slist_append (handle->chunk, header);
+                            free (header);
+                        }
+                    if (!handle->chunk) goto error;
+                    headers = handle->chunk;
+                }
+            if (handle->profile.headers != headers)
+                {
+                    curl_easy_setopt (handle->curl, CURLOPT_HTTPHEADER, headers);
+                    handle->profile.headers = headers;
+                }
         }
-    /* Standard WriteFunction/Data callback. */
-    if (!http->isDummy && !isHeadRequest)
+    if (session->verboseMode) fprintf (stderr, "* End CURLOPT configuration\n");
+    return 0;
+error:
+    free (handle->memchunk.memory);
+    OTHttpHandleReset (handle);
+    return -1;
+}
+
+/* Count the response and learn its size. The hint decays slowly towards smaller
+ * responses so a single large page does not inflate every later allocation. */
+static void
+OTHttpMetricsUpdate (const struct OTSessionContainer *const session,
+                     const struct OTHttpContainer *const http)
+{
+    struct OTHttpMetrics *ptr = (struct OTHttpMetrics *)session->httpMetrics;
+    const struct OTHttpHandle *handle = http->handle;
+    const struct OTHttpMemory *mem = &handle->memchunk;
+    size_t hint;
+    if (!ptr) return;
+
+    atomic_fetch_add_explicit (&ptr->responses, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&ptr->responseBytes, http->responseBytes, memory_order_relaxed);
+    atomic_fetch_add_explicit (&ptr->wireBytes, http->wireBytes, memory_order_relaxed);
+    atomic_fetch_add_explicit (&ptr->reallocations, mem->reallocations, memory_order_relaxed);
+    if (handle->sizeHint && mem->size)
         {
-            if (session->verboseMode) fprintf (stderr, "* Enabled CURLOPT_WRITEDATA. \n");
-            curl_easy_setopt (http->handle, CURLOPT_WRITEFUNCTION, OTHttpCallbackFunction);
-            curl_easy_setopt (http->handle, CURLOPT_WRITEDATA, &memchunk);
+            hint = mem->sizeHint;
+            if (mem->size > hint)
+                hint = mem->size;
+            else
+                hint -= (hint - mem->size) / 4;
+            atomic_store_explicit (handle->sizeHint, hint, memory_order_relaxed);
         }
-    else
-        curl_easy_setopt (http->handle, CURLOPT_WRITEFUNCTION, OTHttpCallBackDummyFunction);
-    /* clientId & clientSecret authorisation. */
-    if (http->isAuthRequest)
+}
+
+/* Collect the result of a performed transfer and release the per-transfer state.
+ * If successful the OTHttpContainer owns an allocated response. Needs to be deallocated
+ * after use! */
+void
+OTHttpFinish (struct OTSessionContainer *const session, struct OTHttpContainer *const http,
+              CURLcode res)
+{
+    struct OTHttpHandle *handle = http->handle;
+    curl_off_t wireBytes = 0;
+    if (res == CURLE_OK)
         {
-            curl_easy_setopt (http->handle, CURLOPT_USERNAME, session->clientId);
-            if (!session->clientSecret) goto end;
-            curl_easy_setopt (http->handle, CURLOPT_PASSWORD, session->clientSecret);
+            http->httpOk = 0;
+            long http_code = 0;
+            curl_easy_getinfo (handle->curl, CURLINFO_RESPONSE_CODE, &http_code);
+            http->responseCode = http_code;
         }
     else
         {
-            chunk = curl_slist_append (chunk, authHeader);
-            if (http->entityTagHeader) chunk = curl_slist_append (chunk, http->entityTagHeader);
-            curl_easy_setopt (http->handle, CURLOPT_HTTPHEADER, chunk);
+            OTHttpBudgetResult (http, res);
+            if (session->verboseMode)
+                fprintf (stderr, "* libcurl error: %s\n", curl_easy_strerror (res));
         }
-    if (session->verboseMode) curl_easy_setopt (http->handle, CURLOPT_VERBOSE, 1L);
+    /* Bytes of the decoded body and of the body as received. */
+    http->responseBytes = handle->memchunk.size;
+    if (curl_easy_getinfo (handle->curl, CURLINFO_SIZE_DOWNLOAD_T, &wireBytes) == CURLE_OK)
+        http->wireBytes = (size_t)wireBytes;
+    OTHttpMetricsUpdate (session, http);
 
-    /* Perform request. */
-    if (session->verboseMode)
-        fprintf (stderr, "* End CURLOPT configuration\n* Call curl_easy_perform...\n");
-
-    res = curl_easy_perform (http->handle);
-    if (res == CURLE_OK)
+    /* Detach the request specific header list before it is freed. */
+    if (handle->chunk && handle->profile.headers == handle->chunk)
         {
-            http->httpOk = 0;
-            long http_code = 0;
-            curl_easy_getinfo (http->handle, CURLINFO_RESPONSE_CODE, &http_code);
-            http->responseCode = http_code;
+            curl_easy_setopt (handle->curl, CURLOPT_HTTPHEADER, NULL);
+            handle->profile.headers = NULL;
         }
+    if (session->verboseMode) fprintf (stderr, "* Free request header list and url\n");
+    http->response = handle->memchunk.memory;
+    http->entityTag = handle->memchunk.headers.entityTag;
+    handle->memchunk.headers.entityTag = NULL;
+    OTHttpHeadersClear (&http->headers);
+    http->headers = handle->memchunk.headers;
+    OTHttpHeadersInit (&handle->memchunk.headers);
+    if (handle->memchunk.stream && res == CURLE_OK)
+        {
+            http->tree = OTJsonStreamFinish (handle->memchunk.stream);
+            handle->memchunk.stream = NULL;
+        }
+    OTHttpHandleReset (handle);
+}
 
-    if (session->verboseMode) fprintf (stderr, "* Call curl_slist_free_all to free chunk\n");
-    curl_slist_free_all (chunk);
-    http->response = memchunk.memory;
-end:
-    if (session->verboseMode) fprintf (stderr, "* Free concatenated url and authHeader\n");
-    free (url);
-    free (authHeader);
+/* Perform a HTTP(s) request using the libcurl easy api. Configure values with the OTHttpContainer.
+ * If successful returns an allocated response. Needs to be deallocated after use!
+ */
+void
+OTHttpRequest (struct OTSessionContainer *const session, struct OTHttpContainer *const http)
+{
+    CURLcode res;
+    long delay;
+    if (OTHttpPrepare (session, http) != 0) return;
+
+    /* Perform request. Repeat it as long as the retry policy allows and once with a renewed
+     * accessToken if it was rejected. Every attempt waits for a token of the rate limit and
+     * is limited to the time left until the deadline of the handle. A cancellation ends
+     * the wait before an attempt at once. */
+    delay = OTHttpLimitAcquire (session, http, 0);
+    for (;;)
+        {
+            res = OTHttpBudgetWait (http->handle, delay);
+            if (res != CURLE_OK) break;
+            if (session->verboseMode) fprintf (stderr, "* Call curl_easy_perform...\n");
+            res = curl_easy_perform (http->handle->curl);
+            delay = OTHttpRetryDelay (session, http, res);
+            if (delay < 0 && OTHttpReauthorise (session, http, res) == 0) delay = 0;
+            if (delay < 0) break;
+            delay = OTHttpLimitAcquire (session, http, delay);
+        }
+    OTHttpFinish (session, http, res);
 }
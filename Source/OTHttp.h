@@ -23,6 +23,12 @@
 #ifndef OTHTTP__h
 #define OTHTTP__h
 
+#include <curl/curl.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "OTHelper.h"
+#include "OTJson.h"
 #include "openTIDAL.h"
 
 enum OTHttpTypes
@@ -34,23 +40,266 @@ enum OTHttpTypes
     HEAD
 };
 
+/* Hosts of a session: baseUrl and authUrl. */
+enum OTHttpHost
+{
+    BASE_HOST,
+    AUTH_HOST,
+    HOST_COUNT
+};
+
+/* libcurl callback and writedata structure. */
+struct OTHttpMemory
+{
+    char *memory;
+    size_t size;
+    size_t capacity;
+    /* Number of reallocations of this response. */
+    size_t reallocations;
+    /* Learned size of previous responses of the same endpoint family. */
+    size_t sizeHint;
+    /* Non-zero if the response body is discarded. */
+    int isDummy;
+    /* If not NULL the response body is parsed while it is received instead of buffered. */
+    struct OTJsonStream *stream;
+    /* Buffer the body even if it is parsed incrementally (for the disk cache). */
+    int isBodyKept;
+    /* Headers captured by the header callback (enum OTHeaders). */
+    unsigned int headerMask;
+    struct OTHeaderContainer headers;
+};
+
+struct OTAsyncRequest;
+
+/* Immutable snapshot of the access-token of a session with its authorisation header list.
+ * Every handle holds a reference to the snapshot of its last request (See OTHttpToken.c). */
+struct OTHttpToken
+{
+    atomic_int references;
+    /* The session values the snapshot was built from. */
+    const char *source;
+    const char *clientId;
+    int restrictedMode;
+    time_t expiresIn;
+    /* Generation of the published token (See OTHttpTokenPublish). */
+    unsigned long generation;
+    struct curl_slist *list;
+};
+
+/* Options currently applied to a libcurl easy handle. Options are only set if they differ
+ * from the previous request. */
+struct OTHttpProfile
+{
+    int isApplied;
+    int verboseMode;
+    int multiplexStreams;
+    int isDummy;
+    int isAuthRequest;
+    int type;
+    const struct curl_slist *headers;
+};
+
+/* The http-handle returned by OTHttpThreadHandleCreate. It wraps the libcurl easy handle
+ * and keeps the state of the transfer between OTHttpPrepare and OTHttpFinish. */
+struct OTHttpHandle
+{
+    CURL *curl;
+    /* Not NULL if the handle is an asynchronous request handle (See OTAsync.c). */
+    struct OTAsyncRequest *asyncRequest;
+    /* The session share object the handle is attached to. */
+    void *share;
+    struct OTHttpMemory memchunk;
+    /* Slot of the learned response size of the current endpoint. */
+    atomic_size_t *sizeHint;
+    /* Request specific header list. NULL if the list of the token snapshot is used. */
+    struct curl_slist *chunk;
+    struct OTHttpToken *token;
+    /* Url of the current request. The memory is reused by the next request. */
+    struct OTUrlBuffer url;
+    struct OTHttpProfile profile;
+    /* Retries of the current request, its deadline and the seed of the backoff jitter. */
+    int attempts;
+    /* Non-zero if the request was replayed after a 401 with a renewed token. */
+    int isReplayed;
+    long long deadline;
+    unsigned int seed;
+    /* Headers captured for every request (See OTHttpThreadHandleHeaders). */
+    unsigned int headerMask;
+    /* Deadline set with OTHttpThreadHandleDeadline, 0 if none, and the cancellation token
+     * attached with OTHttpThreadHandleCancel (See OTHttpCancel.c). */
+    long long callDeadline;
+    struct OTHttpCancel *cancel;
+    /* Non-zero if the last attempt could not start before the deadline. */
+    int isOverBudget;
+};
+
 struct OTHttpContainer
 {
-    void *handle;
+    struct OTHttpHandle *handle;
     enum OTHttpTypes *type;
     int httpOk;
     int isAuthRequest;
     int isDummy;
+    /* Parse the response body incrementally into tree instead of returning it. */
+    int isStreamParsed;
+    /* Non-zero if the response may be stored in the metadata cache. */
+    int isCacheable;
+    /* Non-zero if the response is personalised. It is cached per user. */
+    int isPrivate;
+    /* Non-zero if the endpoint names an artefact by id. Missing artefacts are remembered
+     * by the negative cache. */
+    int isArtefact;
+    /* Non-zero if the request was not performed because the circuit breaker is open. */
+    int isRejected;
+    /* Non-zero if the request was cancelled or exceeded the deadline of its handle. */
+    int isCancelled;
+    int isDeadlineExceeded;
     long responseCode;
+    /* Size of the decoded response body and of the body as received. */
+    size_t responseBytes;
+    size_t wireBytes;
     char *response;
+    struct OTJsonContainer *tree;
+    /* Headers captured in addition to the ones of the handle. */
+    unsigned int headerMask;
+    /* Entity-tag of the response. Only captured for cacheable requests and if requested. */
+    char *entityTag;
+    /* The other captured headers of the response. */
+    struct OTHeaderContainer headers;
     char *entityTagHeader;
+    /* Expired cached response revalidated with If-None-Match. Reused on 304 Not Modified. */
+    struct OTJsonContainer *staleTree;
+    char *staleEntityTag;
+    int isRevalidated;
+    /* Non-zero if the stale tree was returned because the request failed. */
+    int isOffline;
     char *endpoint;
     char *parameter;
     char *postData;
 };
 
+void *OTHttpShareCreate (void);
+int OTHttpShareCleanup (void *share);
+void OTHttpShareAttach (const struct OTSessionContainer *const session,
+                        struct OTHttpHandle *const handle);
+void *OTHttpMetricsCreate (void);
+void OTHttpMetricsCleanup (void *metrics);
+void OTHttpMetricsNegative (const struct OTSessionContainer *const session, const int isHit);
+void OTHttpMetricsThrottle (const struct OTSessionContainer *const session, const long wait);
 void OTHttpContainerInit (struct OTHttpContainer *const http);
 void OTHttpRequest (struct OTSessionContainer *const session, struct OTHttpContainer *const http);
+int OTHttpPrepare (struct OTSessionContainer *const session, struct OTHttpContainer *const http);
+void OTHttpFinish (struct OTSessionContainer *const session, struct OTHttpContainer *const http,
+                   CURLcode res);
+void OTHttpDiscardResponse (struct OTHttpHandle *const handle);
+enum OTStatus OTHttpTransportStatus (const struct OTHttpContainer *const http);
+
+/* Retry policy, replay after 401 and circuit breaker (See OTHttpRetry.c). */
+long long OTHttpTime (void);
+void OTHttpSleep (const long milliseconds);
+void *OTHttpBreakerCreate (void);
+void OTHttpBreakerCleanup (void *breaker);
+int OTHttpBreakerAllow (const struct OTSessionContainer *const session,
+                        const struct OTHttpContainer *const http);
+long OTHttpRetryDelay (const struct OTSessionContainer *const session,
+                       struct OTHttpContainer *const http, const CURLcode res);
+int OTHttpReauthorise (struct OTSessionContainer *const session,
+                       struct OTHttpContainer *const http, const CURLcode res);
+int OTHttpReauthorised (const struct OTSessionContainer *const session,
+                        struct OTHttpContainer *const http);
+
+/* Deadlines and cancellation (See OTHttpCancel.c). */
+CURLcode OTHttpBudget (struct OTHttpHandle *const handle, const long delay);
+CURLcode OTHttpBudgetWait (struct OTHttpHandle *const handle, const long delay);
+int OTHttpBudgetSpent (const struct OTHttpHandle *const handle, const CURLcode res);
+void OTHttpBudgetResult (struct OTHttpContainer *const http, const CURLcode res);
+
+/* Access-token snapshots and single-flight refresh (See OTHttpToken.c). */
+void *OTHttpTokensCreate (void);
+void OTHttpTokensCleanup (void *tokens);
+struct OTHttpToken *OTHttpTokenAcquire (const struct OTSessionContainer *const session);
+void OTHttpTokenRelease (struct OTHttpToken *const token);
+int OTHttpTokenIsExpiring (const struct OTHttpToken *const token);
+int OTHttpTokenIsExpired (const struct OTHttpToken *const token);
+int OTHttpTokenRefreshBegin (const struct OTSessionContainer *const session);
+void OTHttpTokenRefreshEnd (const struct OTSessionContainer *const session);
+void OTHttpTokenRefreshWait (const struct OTSessionContainer *const session);
+void OTHttpTokenPublish (struct OTSessionContainer *const session,
+                         struct OTJsonContainer *const renewalTree, char *const accessToken,
+                         const time_t expiresIn);
+
+/* Background token refresher and recovery of rejected tokens (See OTSessionRefresh.c). */
+int OTSessionRefresherWake (const struct OTSessionContainer *const session);
+int OTSessionRenewInBackground (struct OTSessionContainer *const session);
+enum OTStatus OTSessionRenewRejected (struct OTSessionContainer *session,
+                                      const struct OTHttpToken *const rejected);
+
+/* Client-side rate limit per host (See OTHttpLimit.c). */
+void *OTHttpLimiterCreate (void);
+void OTHttpLimiterCleanup (void *limiter);
+long OTHttpLimitAcquire (const struct OTSessionContainer *const session,
+                         const struct OTHttpContainer *const http, const long delay);
+
+/* Persistent TLS sessions (See OTHttpTicket.c). */
+void *OTHttpTicketsCreate (void);
+void OTHttpTicketsCleanup (void *tickets);
+void OTHttpTicketsAttach (const struct OTSessionContainer *const session, CURL *curl);
+int OTHttpTicketsLoad (const struct OTSessionContainer *const session);
+int OTHttpTicketsSave (const struct OTSessionContainer *const session);
+
+/* Negative cache of missing artefacts (See OTNegativeCache.c). */
+int OTNegativeCacheLookup (const struct OTSessionContainer *const session,
+                           struct OTHttpContainer *const http);
+void OTNegativeCacheStore (const struct OTSessionContainer *const session,
+                           const struct OTHttpContainer *const http);
+
+/* Metadata response cache (See OTCache.c) and its disk-backed layer (See OTDiskCache.c). */
+long long OTCacheTTL (const struct OTSessionContainer *const session, const char *const endpoint,
+                      long long *hardTTL);
+void OTCacheRevalidate (const struct OTSessionContainer *const session,
+                        struct OTHttpContainer *const http);
+void OTCacheFallback (const struct OTSessionContainer *const session,
+                      struct OTHttpContainer *const http);
+char *OTCacheKey (const struct OTSessionContainer *const session,
+                  const struct OTHttpContainer *const http, unsigned long *hash);
+int OTCacheLookup (const struct OTSessionContainer *const session,
+                   struct OTHttpContainer *const http);
+void OTCacheStore (const struct OTSessionContainer *const session,
+                   const struct OTHttpContainer *const http);
+void OTCacheRefreshStart (const struct OTSessionContainer *const session,
+                          const struct OTHttpContainer *const http,
+                          const struct OTJsonContainer *const tree, char *entityTag);
+int OTDiskCacheLookup (const struct OTSessionContainer *const session,
+                       struct OTHttpContainer *const http);
+void OTDiskCacheStore (const struct OTSessionContainer *const session,
+                       const struct OTHttpContainer *const http);
+
+/* Single-flight coalescing of identical GET requests (See OTHttpFlight.c). */
+struct OTHttpFlight;
+void *OTHttpFlightsCreate (void);
+void OTHttpFlightsCleanup (void *flights);
+int OTHttpFlightJoin (const struct OTSessionContainer *const session,
+                      struct OTHttpContainer *const http, struct OTHttpFlight **flight);
+void OTHttpFlightLeave (const struct OTSessionContainer *const session,
+                       struct OTHttpFlight *const flight, const struct OTHttpContainer *const http);
+int OTHttpRefreshBegin (const struct OTSessionContainer *const session);
+void OTHttpRefreshEnd (const struct OTSessionContainer *const session);
+
+/* Asynchronous request engine. The finish function converts the completed OTHttpContainer
+ * into the container handed to the callback. The optional store function runs before it and
+ * updates the caches with the response. */
+typedef void *(*OTAsyncFinishFunction) (struct OTHttpContainer *http, enum OTStatus *status);
+typedef void (*OTAsyncStoreFunction) (const struct OTSessionContainer *const session,
+                                      struct OTHttpContainer *const http);
+int OTAsyncSubmit (struct OTSessionContainer *const session, struct OTHttpContainer *const http,
+                   enum OTTypes type, OTAsyncFinishFunction finish, OTAsyncStoreFunction store);
+void OTAsyncResolve (struct OTSessionContainer *const session, struct OTHttpContainer *const http,
+                     enum OTTypes type, OTAsyncFinishFunction finish);
+void OTAsyncRelease (struct OTHttpHandle *const handle);
 enum OTStatus OTHttpParseStatus (struct OTHttpContainer *const http);
-char *OTHttpParseHeader (char *buffer, char *key);
+unsigned int OTHttpParseHeader (const char *data, size_t length, const char **value,
+                                size_t *valueLength);
+void OTHttpHeadersInit (struct OTHeaderContainer *const headers);
+void OTHttpHeadersClear (struct OTHeaderContainer *const headers);
+void OTHttpHeadersMove (struct OTHttpContainer *const http, struct OTHeaderContainer *headers);
 #endif /* OTHTTP__h */
@@ -0,0 +1,219 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+/* openTIDAL deadlines and cooperative cancellation of requests
+ * A deadline and a cancellation token are attached to an http-handle and apply to every
+ * request performed with it, including the retries and the replay after a 401.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "OTHttp.h"
+#include "openTIDAL.h"
+
+/* A transfer that timed out this close to the deadline exceeded it (milliseconds). */
+#define OTHTTP_DEADLINE_SLACK 10
+
+struct OTHttpCancel
+{
+    atomic_int isCancelled;
+    /* Wakes the requests waiting for a retry or the rate limit (See OTHttpBudgetWait). */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void *
+OTCancelCreate (void)
+{
+    struct OTHttpCancel *ptr = NULL;
+    pthread_condattr_t attr;
+    int isInitialised = 0;
+    ptr = malloc (sizeof (struct OTHttpCancel));
+    if (!ptr) return NULL;
+    atomic_init (&ptr->isCancelled, 0);
+    if (pthread_condattr_init (&attr) == 0)
+        {
+            isInitialised = pthread_condattr_setclock (&attr, CLOCK_MONOTONIC) == 0
+                            && pthread_cond_init (&ptr->cond, &attr) == 0;
+            pthread_condattr_destroy (&attr);
+        }
+    if (!isInitialised) goto error;
+    if (pthread_mutex_init (&ptr->mutex, NULL) != 0)
+        {
+            pthread_cond_destroy (&ptr->cond);
+            goto error;
+        }
+    return ptr;
+error:
+    free (ptr);
+    return NULL;
+}
+
+/* Cancel the requests of every handle the token is attached to. May be called from any
+ * thread. A cancelled token stays cancelled. */
+void
+OTCancelTrigger (void *cancel)
+{
+    struct OTHttpCancel *ptr = (struct OTHttpCancel *)cancel;
+    if (!ptr) return;
+    pthread_mutex_lock (&ptr->mutex);
+    atomic_store (&ptr->isCancelled, 1);
+    pthread_cond_broadcast (&ptr->cond);
+    pthread_mutex_unlock (&ptr->mutex);
+}
+
+/* Detach the token from its handles before. */
+void
+OTCancelCleanup (void *cancel)
+{
+    struct OTHttpCancel *ptr = (struct OTHttpCancel *)cancel;
+    if (!ptr) return;
+    pthread_cond_destroy (&ptr->cond);
+    pthread_mutex_destroy (&ptr->mutex);
+    free (ptr);
+}
+
+static int
+OTHttpIsCancelled (const struct OTHttpCancel *const cancel)
+{
+    return cancel && atomic_load_explicit (&cancel->isCancelled, memory_order_relaxed);
+}
+
+/* CURLOPT_XFERINFOFUNCTION. Aborts a running transfer with CURLE_ABORTED_BY_CALLBACK. */
+static int
+OTHttpCancelProgress (void *userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                      curl_off_t ulnow)
+{
+    return OTHttpIsCancelled ((struct OTHttpCancel *)userp);
+}
+
+/* Attach a cancellation token to a handle. NULL detaches it. */
+void
+OTHttpThreadHandleCancel (void *threadHandle, void *cancel)
+{
+    struct OTHttpHandle *handle = (struct OTHttpHandle *)threadHandle;
+    if (!handle) return;
+    handle->cancel = (struct OTHttpCancel *)cancel;
+    /* libcurl calls the progress function at least once per second, also on a stalled
+     * connection. */
+    curl_easy_setopt (handle->curl, CURLOPT_XFERINFOFUNCTION,
+                      cancel ? OTHttpCancelProgress : NULL);
+    curl_easy_setopt (handle->curl, CURLOPT_XFERINFODATA, cancel);
+    curl_easy_setopt (handle->curl, CURLOPT_NOPROGRESS, cancel ? 0L : 1L);
+}
+
+/* Set the deadline of a handle to milliseconds from now. Requests performed with the handle
+ * until the deadline is changed must finish before it. 0 removes the deadline. */
+void
+OTHttpThreadHandleDeadline (void *threadHandle, const long milliseconds)
+{
+    struct OTHttpHandle *handle = (struct OTHttpHandle *)threadHandle;
+    if (!handle) return;
+    handle->callDeadline = milliseconds > 0 ? OTHttpTime () + milliseconds : 0;
+}
+
+/* Check the cancellation token and the deadline of a handle for an attempt that starts
+ * after delay milliseconds and limit the transfer to the remaining time.
+ * Returns CURLE_OK if the attempt may start, otherwise CURLE_ABORTED_BY_CALLBACK or
+ * CURLE_OPERATION_TIMEDOUT. */
+CURLcode
+OTHttpBudget (struct OTHttpHandle *const handle, const long delay)
+{
+    long long remaining;
+    handle->isOverBudget = 0;
+    if (OTHttpIsCancelled (handle->cancel)) return CURLE_ABORTED_BY_CALLBACK;
+    if (!handle->callDeadline)
+        {
+            curl_easy_setopt (handle->curl, CURLOPT_TIMEOUT_MS, 0L);
+            return CURLE_OK;
+        }
+    remaining = handle->callDeadline - OTHttpTime () - (delay > 0 ? delay : 0);
+    if (remaining <= 0)
+        {
+            handle->isOverBudget = 1;
+            return CURLE_OPERATION_TIMEDOUT;
+        }
+    curl_easy_setopt (handle->curl, CURLOPT_TIMEOUT_MS, (long)remaining);
+    return CURLE_OK;
+}
+
+/* Wait delay milliseconds before an attempt and check the budget of the handle for it. A
+ * cancellation during the wait ends it at once.
+ * Returns the result of OTHttpBudget for the attempt. */
+CURLcode
+OTHttpBudgetWait (struct OTHttpHandle *const handle, const long delay)
+{
+    struct OTHttpCancel *cancel = handle->cancel;
+    struct timespec until;
+    CURLcode res = OTHttpBudget (handle, delay);
+    if (res != CURLE_OK || delay <= 0) return res;
+    if (!cancel)
+        OTHttpSleep (delay);
+    else
+        {
+            clock_gettime (CLOCK_MONOTONIC, &until);
+            until.tv_sec += delay / 1000;
+            until.tv_nsec += (delay % 1000) * 1000000;
+            if (until.tv_nsec >= 1000000000)
+                {
+                    until.tv_sec += 1;
+                    until.tv_nsec -= 1000000000;
+                }
+            pthread_mutex_lock (&cancel->mutex);
+            while (!atomic_load (&cancel->isCancelled)
+                   && pthread_cond_timedwait (&cancel->cond, &cancel->mutex, &until) != ETIMEDOUT)
+                ;
+            pthread_mutex_unlock (&cancel->mutex);
+        }
+    return OTHttpBudget (handle, 0);
+}
+
+/* Returns 1 if the transfer failed because it was cancelled, 2 if it exceeded the deadline
+ * of its handle and 0 otherwise. Such failures are caused by the caller, not the upstream. */
+int
+OTHttpBudgetSpent (const struct OTHttpHandle *const handle, const CURLcode res)
+{
+    if (res == CURLE_ABORTED_BY_CALLBACK && OTHttpIsCancelled (handle->cancel)) return 1;
+    if (res == CURLE_OPERATION_TIMEDOUT && handle->callDeadline
+        && (handle->isOverBudget || OTHttpTime () + OTHTTP_DEADLINE_SLACK >= handle->callDeadline))
+        return 2;
+    return 0;
+}
+
+/* Record if a request failed because it was cancelled or exceeded its deadline. */
+void
+OTHttpBudgetResult (struct OTHttpContainer *const http, const CURLcode res)
+{
+    switch (OTHttpBudgetSpent (http->handle, res))
+        {
+        case 1:
+            http->isCancelled = 1;
+            break;
+        case 2:
+            http->isDeadlineExceeded = 1;
+            break;
+        }
+}
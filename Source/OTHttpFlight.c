@@ -0,0 +1,238 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Single-flight coalescing of identical GET requests
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "OTHelper.h"
+#include "OTHttp.h"
+#include "OTJson.h"
+#include "openTIDAL.h"
+
+/* A request in flight. The leader performs the request, followers with the same key wait
+ * for its result and receive a duplicate of the tree. */
+struct OTHttpFlight
+{
+    char *key;
+    /* Leader and waiting followers. The last one to leave frees the flight. */
+    int references;
+    int isDone;
+    /* Result of the leader. The tree is only duplicated if followers are waiting. */
+    int httpOk;
+    int isRejected;
+    int isOffline;
+    long responseCode;
+    struct OTJsonContainer *tree;
+    struct OTHttpFlight *next;
+};
+
+struct OTHttpFlights
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct OTHttpFlight *head;
+    /* Running background tasks: refreshes of the metadata cache and connection warm-ups. */
+    int refreshes;
+};
+
+void *
+OTHttpFlightsCreate (void)
+{
+    struct OTHttpFlights *ptr = NULL;
+    ptr = malloc (sizeof (struct OTHttpFlights));
+    if (!ptr) return NULL;
+    if (pthread_mutex_init (&ptr->mutex, NULL) != 0)
+        {
+            free (ptr);
+            return NULL;
+        }
+    if (pthread_cond_init (&ptr->cond, NULL) != 0)
+        {
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+            return NULL;
+        }
+    ptr->head = NULL;
+    ptr->refreshes = 0;
+    return ptr;
+}
+
+void
+OTHttpFlightsCleanup (void *flights)
+{
+    struct OTHttpFlights *ptr = (struct OTHttpFlights *)flights;
+    if (ptr)
+        {
+            /* Background refreshes use the session until they are done. */
+            pthread_mutex_lock (&ptr->mutex);
+            while (ptr->refreshes > 0)
+                pthread_cond_wait (&ptr->cond, &ptr->mutex);
+            pthread_mutex_unlock (&ptr->mutex);
+            pthread_cond_destroy (&ptr->cond);
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+        }
+}
+
+static void
+OTHttpFlightRelease (struct OTHttpFlight *const flight)
+{
+    flight->references -= 1;
+    if (flight->references > 0) return;
+    OTJsonDelete (flight->tree);
+    free (flight->key);
+    free (flight);
+}
+
+/* Join an identical request in flight or become its leader. Only blocking GET requests
+ * whose response is parsed into a tree are coalesced.
+ * Returns 0 if the caller has to perform the request. If flight is not NULL afterwards the
+ * caller is the leader and must call OTHttpFlightLeave with the result.
+ * Returns 1 if the OTHttpContainer was filled with the result of another request. */
+int
+OTHttpFlightJoin (const struct OTSessionContainer *const session,
+                  struct OTHttpContainer *const http, struct OTHttpFlight **flight)
+{
+    struct OTHttpFlights *ptr = (struct OTHttpFlights *)session->httpFlights;
+    struct OTHttpFlight *item = NULL;
+    struct OTJsonContainer *tree = NULL;
+    char *key = NULL;
+    const char *base = http->isAuthRequest ? session->authUrl : session->baseUrl;
+
+    *flight = NULL;
+    if (!ptr || *http->type != GET || http->isDummy || !http->isStreamParsed
+        || http->entityTagHeader || !http->endpoint)
+        return 0;
+    /* A follower could not be cancelled or bounded while it waits for the leader and does
+     * not receive the response headers. */
+    if (http->handle
+        && (http->handle->asyncRequest || http->handle->cancel || http->handle->callDeadline
+            || http->handle->headerMask))
+        return 0;
+    OTConcatenateString (&key, "GET %s%s?%s", base, http->endpoint,
+                         http->parameter ? http->parameter : "");
+    if (!key) return 0;
+
+    pthread_mutex_lock (&ptr->mutex);
+    for (item = ptr->head; item; item = item->next)
+        if (strcmp (item->key, key) == 0) break;
+    if (!item)
+        {
+            /* Become the leader. */
+            item = malloc (sizeof (struct OTHttpFlight));
+            if (item)
+                {
+                    item->key = key;
+                    item->references = 1;
+                    item->isDone = 0;
+                    item->httpOk = -1;
+                    item->isRejected = 0;
+                    item->isOffline = 0;
+                    item->responseCode = 0;
+                    item->tree = NULL;
+                    item->next = ptr->head;
+                    ptr->head = item;
+                    *flight = item;
+                }
+            else
+                free (key);
+            pthread_mutex_unlock (&ptr->mutex);
+            return 0;
+        }
+    free (key);
+    item->references += 1;
+    if (session->verboseMode) fprintf (stderr, "* Wait for identical request in flight\n");
+    while (!item->isDone)
+        pthread_cond_wait (&ptr->cond, &ptr->mutex);
+    pthread_mutex_unlock (&ptr->mutex);
+
+    /* The tree is not modified until the last follower leaves. */
+    if (item->tree)
+        tree = OTJsonDuplicate (item->tree, 1);
+    http->httpOk = item->httpOk;
+    http->isRejected = item->isRejected;
+    http->isOffline = item->isOffline;
+    http->responseCode = item->responseCode;
+    http->tree = tree;
+
+    pthread_mutex_lock (&ptr->mutex);
+    OTHttpFlightRelease (item);
+    pthread_mutex_unlock (&ptr->mutex);
+    return 1;
+}
+
+/* Publish the result of the leader and wake the followers. */
+void
+OTHttpFlightLeave (const struct OTSessionContainer *const session,
+                   struct OTHttpFlight *const flight, const struct OTHttpContainer *const http)
+{
+    struct OTHttpFlights *ptr = (struct OTHttpFlights *)session->httpFlights;
+    struct OTHttpFlight **link = NULL;
+    if (!flight) return;
+
+    pthread_mutex_lock (&ptr->mutex);
+    for (link = &ptr->head; *link; link = &(*link)->next)
+        if (*link == flight)
+            {
+                *link = flight->next;
+                break;
+            }
+    /* No new followers can join, copy the tree only for the waiting ones. */
+    if (flight->references > 1 && http->tree)
+        flight->tree = OTJsonDuplicate (http->tree, 1);
+    flight->httpOk = http->httpOk;
+    flight->isRejected = http->isRejected;
+    flight->isOffline = http->isOffline;
+    flight->responseCode = http->responseCode;
+    flight->isDone = 1;
+    pthread_cond_broadcast (&ptr->cond);
+    OTHttpFlightRelease (flight);
+    pthread_mutex_unlock (&ptr->mutex);
+}
+
+/* Register a background refresh of the metadata cache (See OTCache.c). Returns 0 on
+ * success. */
+int
+OTHttpRefreshBegin (const struct OTSessionContainer *const session)
+{
+    struct OTHttpFlights *ptr = (struct OTHttpFlights *)session->httpFlights;
+    if (!ptr) return -1;
+    pthread_mutex_lock (&ptr->mutex);
+    ptr->refreshes += 1;
+    pthread_mutex_unlock (&ptr->mutex);
+    return 0;
+}
+
+void
+OTHttpRefreshEnd (const struct OTSessionContainer *const session)
+{
+    struct OTHttpFlights *ptr = (struct OTHttpFlights *)session->httpFlights;
+    pthread_mutex_lock (&ptr->mutex);
+    ptr->refreshes -= 1;
+    if (ptr->refreshes == 0) pthread_cond_broadcast (&ptr->cond);
+    pthread_mutex_unlock (&ptr->mutex);
+}
@@ -0,0 +1,149 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Client-side rate limit per host
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "OTHttp.h"
+#include "openTIDAL.h"
+
+/* Token bucket of a host in its virtual scheduling form: the bucket is full at time
+ * tolerance before tat (the theoretical arrival time) and every request moves tat by the
+ * emission interval. A single compare-and-swap of tat takes a token, so the bucket is
+ * shared by all handles without a lock. Times in microseconds. */
+struct OTHttpLimitHost
+{
+    atomic_llong tat;
+    /* Time to refill one token. 0 if the host is not limited. */
+    atomic_llong emission;
+    /* Time to refill the whole bucket minus one token. */
+    atomic_llong tolerance;
+};
+
+struct OTHttpLimiter
+{
+    struct OTHttpLimitHost hosts[HOST_COUNT];
+};
+
+/* Monotonic clock in microseconds. */
+static long long
+OTHttpLimitClock (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void *
+OTHttpLimiterCreate (void)
+{
+    struct OTHttpLimiter *ptr = NULL;
+    int i;
+    ptr = malloc (sizeof (struct OTHttpLimiter));
+    if (!ptr) return NULL;
+    for (i = 0; i < HOST_COUNT; i++)
+        {
+            atomic_init (&ptr->hosts[i].tat, 0);
+            atomic_init (&ptr->hosts[i].emission, 0);
+            atomic_init (&ptr->hosts[i].tolerance, 0);
+        }
+    return ptr;
+}
+
+void
+OTHttpLimiterCleanup (void *limiter)
+{
+    free (limiter);
+}
+
+/* Limit the requests to the authUrl host if isAuthHost is non-zero, otherwise to the
+ * baseUrl host, to requests per interval milliseconds. Up to burst requests are sent
+ * without waiting after the host was idle. A requests value of 0 removes the limit. */
+void
+OTSessionRateLimit (struct OTSessionContainer *const session, const int isAuthHost,
+                    const long requests, const long interval, const long burst)
+{
+    struct OTHttpLimiter *ptr = (struct OTHttpLimiter *)session->httpLimiter;
+    struct OTHttpLimitHost *host = NULL;
+    long long emission = 0;
+    if (!ptr) return;
+
+    host = &ptr->hosts[isAuthHost ? AUTH_HOST : BASE_HOST];
+    if (requests > 0 && interval > 0)
+        {
+            emission = (long long)interval * 1000 / requests;
+            if (emission < 1) emission = 1;
+        }
+    atomic_store_explicit (&host->tolerance, emission * (burst > 1 ? burst - 1 : 0),
+                           memory_order_relaxed);
+    atomic_store_explicit (&host->emission, emission, memory_order_relaxed);
+}
+
+/* Take a token for an attempt that is started after delay milliseconds. A request that
+ * exceeds the rate is delayed until its token is refilled. No token is taken for an attempt
+ * that can not start before the deadline of its handle, OTHttpBudget rejects it.
+ * Returns the delay in milliseconds including the wait for the token. */
+long
+OTHttpLimitAcquire (const struct OTSessionContainer *const session,
+                    const struct OTHttpContainer *const http, const long delay)
+{
+    struct OTHttpLimiter *ptr = (struct OTHttpLimiter *)session->httpLimiter;
+    struct OTHttpLimitHost *host = NULL;
+    long long emission;
+    long long tolerance;
+    long long at;
+    long long tat;
+    long long start;
+    long long wait;
+    long long deadline;
+    if (!ptr || delay < 0) return delay;
+
+    host = &ptr->hosts[http->isAuthRequest ? AUTH_HOST : BASE_HOST];
+    emission = atomic_load_explicit (&host->emission, memory_order_relaxed);
+    if (!emission) return delay;
+    tolerance = atomic_load_explicit (&host->tolerance, memory_order_relaxed);
+    deadline = http->handle ? http->handle->callDeadline : 0;
+
+    at = OTHttpLimitClock () + (long long)delay * 1000;
+    tat = atomic_load_explicit (&host->tat, memory_order_relaxed);
+    do
+        {
+            start = tat > at ? tat : at;
+            wait = start - tolerance - at;
+            if (deadline
+                && OTHttpTime () + delay + (wait > 0 ? (wait + 999) / 1000 : 0) >= deadline)
+                return delay + (wait > 0 ? (long)((wait + 999) / 1000) : 0);
+        }
+    while (!atomic_compare_exchange_weak_explicit (&host->tat, &tat, start + emission,
+                                                   memory_order_relaxed, memory_order_relaxed));
+    if (wait <= 0) return delay;
+
+    wait = (wait + 999) / 1000;
+    OTHttpMetricsThrottle (session, (long)wait);
+    if (session->verboseMode) fprintf (stderr, "* Rate limit, wait %lld ms\n", wait);
+    return delay + (long)wait;
+}
@@ -23,7 +23,9 @@
 /* Parse a http request and create the json structure
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "OTHttp.h"
 #include "OTJson.h"
@@ -69,27 +71,76 @@ OTHttpParseStatus (struct OTHttpContainer *const http)
     return status;
 }
 
-char *
-OTHttpParseHeader (char *buffer, char *key)
+/* Response headers recognised by OTHttpParseHeader. */
+static const struct
 {
-    const char delim[] = "\n";
-    char *value = NULL, *token = NULL, *sep = NULL;
-    int i;
+    const char *name;
+    size_t length;
+    enum OTHeaders header;
+} OTHttpHeaderNames[] = {
+    { "etag", 4, HEADER_ENTITY_TAG },
+    { "content-length", 14, HEADER_CONTENT_LENGTH },
+    { "retry-after", 11, HEADER_RETRY_AFTER },
+    { "cache-control", 13, HEADER_CACHE_CONTROL },
+};
 
-    token = strtok (buffer, delim);
-    while (token != NULL)
+/* Match a header line of the header callback. The name is compared case-insensitively.
+ * Returns the header and points value at its trimmed value inside the line, or 0 if the
+ * header is not recognised. */
+unsigned int
+OTHttpParseHeader (const char *data, size_t length, const char **value, size_t *valueLength)
+{
+    const char *colon = memchr (data, ':', length);
+    const char *end = data + length;
+    size_t i;
+
+    if (!colon) return 0;
+    for (i = 0; i < sizeof (OTHttpHeaderNames) / sizeof (OTHttpHeaderNames[0]); i++)
+        if ((size_t)(colon - data) == OTHttpHeaderNames[i].length
+            && strncasecmp (data, OTHttpHeaderNames[i].name, OTHttpHeaderNames[i].length) == 0)
+            break;
+    if (i == sizeof (OTHttpHeaderNames) / sizeof (OTHttpHeaderNames[0])) return 0;
+    for (data = colon + 1; data < end && (*data == ' ' || *data == '\t'); data++)
+        ;
+    while (end > data
+           && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *value = data;
+    *valueLength = end - data;
+    return OTHttpHeaderNames[i].header;
+}
+
+void
+OTHttpHeadersInit (struct OTHeaderContainer *const headers)
+{
+    headers->entityTag = NULL;
+    headers->cacheControl = NULL;
+    headers->contentLength = -1;
+    headers->retryAfter = -1;
+}
+
+void
+OTHttpHeadersClear (struct OTHeaderContainer *const headers)
+{
+    free (headers->entityTag);
+    free (headers->cacheControl);
+    OTHttpHeadersInit (headers);
+}
+
+/* Move the headers requested for the handle of a finished request to the headers of its
+ * container. The entity-tag is copied, the caches may still use it. If headers is NULL the
+ * captured headers are freed. */
+void
+OTHttpHeadersMove (struct OTHttpContainer *const http, struct OTHeaderContainer *headers)
+{
+    const unsigned int mask = http->handle ? http->handle->headerMask : 0;
+    if (headers)
         {
-            i = 0;
-            if (strncmp (token, key, strlen (key)) == 0)
-                {
-                    while ((sep = strsep (&token, ":")) != NULL)
-                        {
-                            if (i == 1)
-                                value = sep + 1;
-                            i += 1;
-                        }
-                }
-            token = strtok (NULL, delim);
+            *headers = http->headers;
+            OTHttpHeadersInit (&http->headers);
+            if (mask & HEADER_ENTITY_TAG && http->entityTag)
+                headers->entityTag = strdup (http->entityTag);
         }
-    return value;
+    else
+        OTHttpHeadersClear (&http->headers);
 }
@@ -0,0 +1,345 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Retry policy, replay after 401 and per-host circuit breaker
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "OTHttp.h"
+#include "openTIDAL.h"
+
+/* Backoff of the n-th retry is between half and the full value of base * 2^n, capped. */
+#define OTHTTP_BACKOFF_BASE 250
+#define OTHTTP_BACKOFF_CAP 8000
+/* Consecutive failures that open the breaker and the time it stays open (milliseconds). */
+#define OTHTTP_BREAKER_THRESHOLD 5
+#define OTHTTP_BREAKER_COOLDOWN 10000
+
+struct OTHttpBreakerHost
+{
+    int failures;
+    /* The breaker is open until this time. 0 if closed. */
+    long long openUntil;
+};
+
+struct OTHttpBreaker
+{
+    pthread_mutex_t mutex;
+    struct OTHttpBreakerHost hosts[HOST_COUNT];
+};
+
+/* Monotonic clock in milliseconds. */
+long long
+OTHttpTime (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+OTHttpSleep (const long milliseconds)
+{
+    struct timespec ts;
+    ts.tv_sec = milliseconds / 1000;
+    ts.tv_nsec = (milliseconds % 1000) * 1000000;
+    while (nanosleep (&ts, &ts) != 0)
+        ;
+}
+
+void *
+OTHttpBreakerCreate (void)
+{
+    struct OTHttpBreaker *ptr = NULL;
+    int i;
+    ptr = malloc (sizeof (struct OTHttpBreaker));
+    if (!ptr) return NULL;
+    if (pthread_mutex_init (&ptr->mutex, NULL) != 0)
+        {
+            free (ptr);
+            return NULL;
+        }
+    for (i = 0; i < HOST_COUNT; i++)
+        {
+            ptr->hosts[i].failures = 0;
+            ptr->hosts[i].openUntil = 0;
+        }
+    return ptr;
+}
+
+void
+OTHttpBreakerCleanup (void *breaker)
+{
+    struct OTHttpBreaker *ptr = (struct OTHttpBreaker *)breaker;
+    if (ptr)
+        {
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+        }
+}
+
+/* Check if a request to the host of the OTHttpContainer may be performed. After the
+ * cooldown a single probe request is let through, its result closes or reopens the breaker.
+ * Returns 0 if allowed, -1 if the breaker is open. */
+int
+OTHttpBreakerAllow (const struct OTSessionContainer *const session,
+                    const struct OTHttpContainer *const http)
+{
+    struct OTHttpBreaker *ptr = (struct OTHttpBreaker *)session->httpBreaker;
+    struct OTHttpBreakerHost *host = NULL;
+    long long now;
+    int status = 0;
+    if (!ptr) return 0;
+
+    host = &ptr->hosts[http->isAuthRequest ? AUTH_HOST : BASE_HOST];
+    pthread_mutex_lock (&ptr->mutex);
+    if (host->openUntil)
+        {
+            now = OTHttpTime ();
+            if (now < host->openUntil)
+                status = -1;
+            else /* Half-open: reject everything else until the probe reports. */
+                host->openUntil = now + OTHTTP_BREAKER_COOLDOWN;
+        }
+    pthread_mutex_unlock (&ptr->mutex);
+    return status;
+}
+
+static void
+OTHttpBreakerReport (const struct OTSessionContainer *const session,
+                     const struct OTHttpContainer *const http, const int isFailure)
+{
+    struct OTHttpBreaker *ptr = (struct OTHttpBreaker *)session->httpBreaker;
+    struct OTHttpBreakerHost *host = NULL;
+    if (!ptr) return;
+
+    host = &ptr->hosts[http->isAuthRequest ? AUTH_HOST : BASE_HOST];
+    pthread_mutex_lock (&ptr->mutex);
+    if (!isFailure)
+        {
+            host->failures = 0;
+            host->openUntil = 0;
+        }
+    else
+        {
+            host->failures += 1;
+            /* A failed probe reopens the breaker immediately. */
+            if (host->failures >= OTHTTP_BREAKER_THRESHOLD || host->openUntil)
+                {
+                    host->openUntil = OTHttpTime () + OTHTTP_BREAKER_COOLDOWN;
+                    if (session->verboseMode)
+                        fprintf (stderr, "* Circuit breaker opened after %d failures\n",
+                                 host->failures);
+                }
+        }
+    pthread_mutex_unlock (&ptr->mutex);
+}
+
+/* Transport errors after which a request can be repeated. Requests with a body are only
+ * repeated if the connection was never established. */
+static int
+OTHttpRetryTransport (const CURLcode res, const int isIdempotent)
+{
+    switch (res)
+        {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_SSL_CONNECT_ERROR:
+            return 1;
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            return isIdempotent;
+        default:
+            return 0;
+        }
+}
+
+/* Decide if a performed transfer is repeated and report its result to the breaker.
+ * 429 and 503 mean the request was not processed and are retried for every method, other
+ * server errors only for idempotent methods. The delay honors the Retry-After header,
+ * otherwise it is an exponential backoff with jitter. Retries are limited by the retry
+ * limit and the deadline of the session. A transfer aborted by the cancellation token or
+ * the deadline of its handle is final and not reported.
+ * Returns the delay in milliseconds before the next attempt or -1 if the result is final.
+ * If a retry is scheduled the partial response is discarded. */
+long
+OTHttpRetryDelay (const struct OTSessionContainer *const session,
+                  struct OTHttpContainer *const http, const CURLcode res)
+{
+    struct OTHttpHandle *handle = http->handle;
+    const int isIdempotent = *http->type != POST;
+    long responseCode = 0;
+    curl_off_t retryAfter = 0;
+    long long delay;
+    long long backoff;
+    int isRetryable = 0;
+    int isFailure = 0;
+
+    if (OTHttpBudgetSpent (handle, res)) return -1;
+    if (res != CURLE_OK)
+        {
+            isFailure = 1;
+            isRetryable = OTHttpRetryTransport (res, isIdempotent);
+        }
+    else
+        {
+            curl_easy_getinfo (handle->curl, CURLINFO_RESPONSE_CODE, &responseCode);
+            if (responseCode == 429 || responseCode == 503)
+                isRetryable = 1;
+            else if (responseCode == 500 || responseCode == 502 || responseCode == 504)
+                isRetryable = isIdempotent;
+            /* Rate limiting is not a sign of an unhealthy upstream. */
+            isFailure = responseCode >= 500;
+        }
+    OTHttpBreakerReport (session, http, isFailure);
+    if (!isRetryable || handle->attempts >= session->retryLimit) return -1;
+
+    if (res == CURLE_OK
+        && curl_easy_getinfo (handle->curl, CURLINFO_RETRY_AFTER, &retryAfter) == CURLE_OK
+        && retryAfter > 0)
+        delay = (long long)retryAfter * 1000;
+    else
+        {
+            backoff = (long long)OTHTTP_BACKOFF_BASE << handle->attempts;
+            if (backoff > OTHTTP_BACKOFF_CAP) backoff = OTHTTP_BACKOFF_CAP;
+            delay = backoff / 2 + rand_r (&handle->seed) % (backoff / 2 + 1);
+        }
+    /* The deadline includes the one of the handle, OTHttpBudget rejects an attempt starting
+     * at it. The last response is returned instead. */
+    if (OTHttpTime () + delay >= handle->deadline) return -1;
+    if (OTHttpBreakerAllow (session, http) != 0) return -1;
+
+    handle->attempts += 1;
+    if (session->verboseMode)
+        fprintf (stderr, "* Retry %d in %lld ms\n", handle->attempts, delay);
+    OTHttpDiscardResponse (handle);
+    return (long)delay;
+}
+
+/* Append to a header list. The list is freed if the append fails. */
+static struct curl_slist *
+OTHttpListAppend (struct curl_slist *list, const char *data)
+{
+    struct curl_slist *next = curl_slist_append (list, data);
+    if (!next) curl_slist_free_all (list);
+    return next;
+}
+
+/* Switch the handle to the token published in place of the one of its last transfer. The
+ * header list is rebuilt with the new authorisation header, additional headers of the
+ * request are kept. Returns 0 if the handle was switched, 1 if no other token is published
+ * yet and -1 if the list can not be built. */
+int
+OTHttpReauthorised (const struct OTSessionContainer *const session,
+                    struct OTHttpContainer *const http)
+{
+    struct OTHttpHandle *handle = http->handle;
+    struct OTHttpToken *token = NULL;
+    struct curl_slist *chunk = NULL;
+    const struct curl_slist *headers = NULL;
+    const struct curl_slist *item = NULL;
+    int skip = 0;
+
+    token = OTHttpTokenAcquire (session);
+    if (!token) return -1;
+    /* The snapshot of the handle is referenced, its address can not be reused. */
+    if (token == handle->token)
+        {
+            OTHttpTokenRelease (token);
+            return 1;
+        }
+
+    headers = token->list;
+    if (handle->chunk)
+        {
+            /* The request specific list starts with a copy of the token list. */
+            for (item = handle->token->list; item; item = item->next)
+                skip += 1;
+            for (item = token->list; item; item = item->next)
+                if (!(chunk = OTHttpListAppend (chunk, item->data))) break;
+            for (item = handle->chunk; item && chunk; item = item->next)
+                if (skip > 0)
+                    skip -= 1;
+                else
+                    chunk = OTHttpListAppend (chunk, item->data);
+            if (!chunk)
+                {
+                    OTHttpTokenRelease (token);
+                    return -1;
+                }
+            headers = chunk;
+        }
+    curl_easy_setopt (handle->curl, CURLOPT_HTTPHEADER, headers);
+    handle->profile.headers = headers;
+    curl_slist_free_all (handle->chunk);
+    handle->chunk = chunk;
+    OTHttpTokenRelease (handle->token);
+    handle->token = token;
+    return 0;
+}
+
+/* Replay a request once after the server rejected its token with 401. The token is renewed
+ * (See OTSessionRenewRejected) and the handle switched to it. Asynchronous request handles
+ * do not block: the renewal is handed to the background refresher and the request waits in
+ * the engine until OTHttpReauthorised switches it.
+ * Returns 0 if the request is replayed, 1 if it waits for the renewal and -1 if the result
+ * is final. If replayed the partial response is discarded. */
+int
+OTHttpReauthorise (struct OTSessionContainer *const session, struct OTHttpContainer *const http,
+                   const CURLcode res)
+{
+    struct OTHttpHandle *handle = http->handle;
+    long responseCode = 0;
+    int status;
+
+    if (res != CURLE_OK || http->isAuthRequest || handle->isReplayed || !handle->token)
+        return -1;
+    curl_easy_getinfo (handle->curl, CURLINFO_RESPONSE_CODE, &responseCode);
+    if (responseCode != 401) return -1;
+    if (session->restrictedMode || !session->refreshToken) return -1;
+    if (handle->asyncRequest)
+        {
+            status = OTHttpReauthorised (session, http);
+            if (status == 1 && OTSessionRenewInBackground (session) != 0) status = -1;
+        }
+    else if (OTSessionRenewRejected (session, handle->token) != SUCCESS)
+        status = -1;
+    else if (OTHttpReauthorised (session, http) != 0)
+        status = -1;
+    else
+        status = 0;
+    if (status < 0) return -1;
+
+    handle->isReplayed = 1;
+    if (session->verboseMode) fprintf (stderr, "* Replay request with renewed accessToken\n");
+    OTHttpDiscardResponse (handle);
+    return status;
+}
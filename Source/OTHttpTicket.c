@@ -0,0 +1,420 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+/* openTIDAL TLS session store
+ * libcurl keeps TLS sessions in memory only. The store captures the sessions negotiated by
+ * the OpenSSL backend and writes them next to the persistent config, a restarted process
+ * resumes them instead of performing a full handshake.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+#ifdef OT_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+#include "OTHttp.h"
+#include "openTIDAL.h"
+
+#define OTHTTP_TICKETS_MAGIC 0x4f54544b
+#define OTHTTP_TICKETS_VERSION 1
+/* Hosts with a stored session. Only the newest session of a host is kept. */
+#define OTHTTP_TICKETS_HOSTS 8
+/* Maximum size of a serialised session. */
+#define OTHTTP_TICKETS_LENGTH 16384
+
+struct OTHttpTicketsHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+};
+
+struct OTHttpTicketRecord
+{
+    uint32_t hostLength;
+    uint32_t sessionLength;
+    int64_t expires;
+};
+
+struct OTHttpTicket
+{
+    char *host;
+    /* DER encoded session. */
+    unsigned char *session;
+    size_t length;
+    time_t expires;
+};
+
+struct OTHttpTickets
+{
+    pthread_mutex_t mutex;
+    struct OTHttpTicket entries[OTHTTP_TICKETS_HOSTS];
+    /* Set if a session was captured since the store was loaded or saved. */
+    int isChanged;
+    /* Set if libcurl uses the OpenSSL library linked into openTIDAL. */
+    int isSupported;
+#ifdef OT_OPENSSL
+    /* The new-session callback of libcurl. Captured sessions are handed on to it. */
+    int (*chained) (SSL *ssl, SSL_SESSION *session);
+#endif
+};
+
+void *
+OTHttpTicketsCreate (void)
+{
+    struct OTHttpTickets *ptr = NULL;
+    ptr = calloc (1, sizeof (struct OTHttpTickets));
+    if (!ptr) return NULL;
+    pthread_mutex_init (&ptr->mutex, NULL);
+#ifdef OT_OPENSSL
+    {
+        const curl_version_info_data *info = curl_version_info (CURLVERSION_NOW);
+        char prefix[16];
+        /* SSL_CTX and SSL_SESSION are only compatible with the same major version. */
+        snprintf (prefix, sizeof (prefix), "OpenSSL/%d.", (int)(OPENSSL_VERSION_NUMBER >> 28));
+        ptr->isSupported
+            = info->ssl_version && strncmp (info->ssl_version, prefix, strlen (prefix)) == 0;
+    }
+#endif
+    return ptr;
+}
+
+void
+OTHttpTicketsCleanup (void *tickets)
+{
+    struct OTHttpTickets *ptr = (struct OTHttpTickets *)tickets;
+    int i;
+    if (ptr)
+        {
+            for (i = 0; i < OTHTTP_TICKETS_HOSTS; i++)
+                {
+                    free (ptr->entries[i].host);
+                    free (ptr->entries[i].session);
+                }
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+        }
+}
+
+/* Find the entry of a host. If isInsert is set and the host has no entry, an empty entry or
+ * the one expiring first is cleared and returned. Call with the mutex held. */
+static struct OTHttpTicket *
+OTHttpTicketsFind (struct OTHttpTickets *const ptr, const char *const host, const int isInsert)
+{
+    struct OTHttpTicket *victim = NULL;
+    int i;
+    for (i = 0; i < OTHTTP_TICKETS_HOSTS; i++)
+        {
+            struct OTHttpTicket *entry = &ptr->entries[i];
+            if (entry->host && strcmp (entry->host, host) == 0) return entry;
+            if (!victim || (victim->host && (!entry->host || entry->expires < victim->expires)))
+                victim = entry;
+        }
+    if (!isInsert) return NULL;
+    free (victim->host);
+    free (victim->session);
+    memset (victim, 0, sizeof (struct OTHttpTicket));
+    return victim;
+}
+
+/* Store a DER encoded session of a host. Takes ownership of the session. */
+static void
+OTHttpTicketsStore (struct OTHttpTickets *const ptr, const char *const host,
+                    unsigned char *const session, const size_t length, const time_t expires)
+{
+    struct OTHttpTicket *entry;
+    pthread_mutex_lock (&ptr->mutex);
+    entry = OTHttpTicketsFind (ptr, host, 1);
+    if (!entry->host) entry->host = strdup (host);
+    if (entry->host)
+        {
+            free (entry->session);
+            entry->session = session;
+            entry->length = length;
+            entry->expires = expires;
+            ptr->isChanged = 1;
+        }
+    else
+        free (session);
+    pthread_mutex_unlock (&ptr->mutex);
+}
+
+#ifdef OT_OPENSSL
+static int OTHttpTicketsIndex = -1;
+static pthread_once_t OTHttpTicketsOnce = PTHREAD_ONCE_INIT;
+
+static void
+OTHttpTicketsIndexInit (void)
+{
+    OTHttpTicketsIndex = SSL_CTX_get_ex_new_index (0, NULL, NULL, NULL, NULL);
+}
+
+/* Called by OpenSSL for every session the server hands out. */
+static int
+OTHttpTicketsNewSession (SSL *ssl, SSL_SESSION *session)
+{
+    struct OTHttpTickets *ptr = SSL_CTX_get_ex_data (SSL_get_SSL_CTX (ssl), OTHttpTicketsIndex);
+    const char *host = SSL_get_servername (ssl, TLSEXT_NAMETYPE_host_name);
+    int (*chained) (SSL *, SSL_SESSION *);
+    int length;
+
+    if (!ptr) return 0;
+    length = i2d_SSL_SESSION (session, NULL);
+    if (host && SSL_SESSION_is_resumable (session) && length > 0
+        && length <= OTHTTP_TICKETS_LENGTH)
+        {
+            unsigned char *der = malloc (length);
+            unsigned char *p = der;
+            if (der && i2d_SSL_SESSION (session, &p) == length)
+                OTHttpTicketsStore (ptr, host, der, length,
+                                    SSL_SESSION_get_time (session)
+                                        + SSL_SESSION_get_timeout (session));
+            else
+                free (der);
+        }
+    pthread_mutex_lock (&ptr->mutex);
+    chained = ptr->chained;
+    pthread_mutex_unlock (&ptr->mutex);
+    /* Returns 1 if libcurl kept a reference to the session. */
+    return chained ? chained (ssl, session) : 0;
+}
+
+/* Called by OpenSSL before the ClientHello is written. If libcurl has no session of the
+ * host in memory, the stored one is offered. */
+static void
+OTHttpTicketsHandshake (const SSL *ssl, int where, int ret)
+{
+    struct OTHttpTickets *ptr;
+    struct OTHttpTicket *entry;
+    SSL_SESSION *session = NULL;
+    const char *host;
+
+    if (!(where & SSL_CB_HANDSHAKE_START) || SSL_get_session (ssl)) return;
+    ptr = SSL_CTX_get_ex_data (SSL_get_SSL_CTX (ssl), OTHttpTicketsIndex);
+    host = SSL_get_servername (ssl, TLSEXT_NAMETYPE_host_name);
+    if (!ptr || !host) return;
+
+    pthread_mutex_lock (&ptr->mutex);
+    entry = OTHttpTicketsFind (ptr, host, 0);
+    if (entry && entry->session && entry->expires > time (NULL))
+        {
+            const unsigned char *p = entry->session;
+            session = d2i_SSL_SESSION (NULL, &p, (long)entry->length);
+        }
+    pthread_mutex_unlock (&ptr->mutex);
+    if (session)
+        {
+            SSL_set_session ((SSL *)ssl, session);
+            SSL_SESSION_free (session);
+        }
+}
+
+/* CURLOPT_SSL_CTX_FUNCTION. Installs the callbacks on the context of a new connection. */
+static CURLcode
+OTHttpTicketsContext (CURL *curl, void *context, void *userp)
+{
+    struct OTHttpTickets *ptr = (struct OTHttpTickets *)userp;
+    SSL_CTX *ctx = (SSL_CTX *)context;
+    int (*chained) (SSL *, SSL_SESSION *);
+
+    pthread_once (&OTHttpTicketsOnce, OTHttpTicketsIndexInit);
+    if (OTHttpTicketsIndex < 0 || !SSL_CTX_set_ex_data (ctx, OTHttpTicketsIndex, ptr))
+        return CURLE_OK;
+    chained = SSL_CTX_sess_get_new_cb (ctx);
+    if (chained != OTHttpTicketsNewSession)
+        {
+            pthread_mutex_lock (&ptr->mutex);
+            ptr->chained = chained;
+            pthread_mutex_unlock (&ptr->mutex);
+        }
+    SSL_CTX_set_session_cache_mode (ctx, SSL_CTX_get_session_cache_mode (ctx)
+                                             | SSL_SESS_CACHE_CLIENT
+                                             | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_sess_set_new_cb (ctx, OTHttpTicketsNewSession);
+    SSL_CTX_set_info_callback (ctx, OTHttpTicketsHandshake);
+    return CURLE_OK;
+}
+#endif
+
+/* Let the connections of a handle store and resume sessions. */
+void
+OTHttpTicketsAttach (const struct OTSessionContainer *const session, CURL *curl)
+{
+#ifdef OT_OPENSSL
+    struct OTHttpTickets *ptr = (struct OTHttpTickets *)session->httpTickets;
+    if (!ptr || !ptr->isSupported) return;
+    curl_easy_setopt (curl, CURLOPT_SSL_CTX_FUNCTION, OTHttpTicketsContext);
+    curl_easy_setopt (curl, CURLOPT_SSL_CTX_DATA, ptr);
+#endif
+}
+
+/* The store is kept next to the persistent config.
+ * Returns a heap allocated string, free it after use! */
+static char *
+OTHttpTicketsLocation (const struct OTSessionContainer *const session)
+{
+    char *location;
+    size_t length;
+    if (!session->persistentFileLocation) return NULL;
+    length = strlen (session->persistentFileLocation) + sizeof (".tls");
+    location = malloc (length);
+    if (location) snprintf (location, length, "%s.tls", session->persistentFileLocation);
+    return location;
+}
+
+/* Load the stored sessions. A missing or malformed file leaves the store empty. */
+int
+OTHttpTicketsLoad (const struct OTSessionContainer *const session)
+{
+    struct OTHttpTickets *ptr = (struct OTHttpTickets *)session->httpTickets;
+    struct OTHttpTicketsHeader header;
+    char *location = NULL;
+    FILE *fp = NULL;
+    time_t now = time (NULL);
+    uint32_t i;
+    int status = -1;
+
+    if (!ptr || !ptr->isSupported) goto end;
+    location = OTHttpTicketsLocation (session);
+    if (!location) goto end;
+    fp = fopen (location, "rb");
+    if (!fp) goto end;
+    if (fread (&header, sizeof (header), 1, fp) != 1 || header.magic != OTHTTP_TICKETS_MAGIC
+        || header.version != OTHTTP_TICKETS_VERSION)
+        goto end;
+
+    for (i = 0; i < header.count && i < OTHTTP_TICKETS_HOSTS; i++)
+        {
+            struct OTHttpTicketRecord record;
+            char *host;
+            unsigned char *der;
+
+            if (fread (&record, sizeof (record), 1, fp) != 1 || record.hostLength == 0
+                || record.hostLength > 255 || record.sessionLength == 0
+                || record.sessionLength > OTHTTP_TICKETS_LENGTH)
+                goto end;
+            host = malloc (record.hostLength + 1);
+            der = malloc (record.sessionLength);
+            if (!host || !der || fread (host, record.hostLength, 1, fp) != 1
+                || fread (der, record.sessionLength, 1, fp) != 1)
+                {
+                    free (host);
+                    free (der);
+                    goto end;
+                }
+            host[record.hostLength] = '\0';
+            if (record.expires > now)
+                OTHttpTicketsStore (ptr, host, der, record.sessionLength,
+                                    (time_t)record.expires);
+            else
+                free (der);
+            free (host);
+        }
+    status = 0;
+end:
+    if (ptr)
+        {
+            pthread_mutex_lock (&ptr->mutex);
+            ptr->isChanged = 0;
+            pthread_mutex_unlock (&ptr->mutex);
+        }
+    if (fp) fclose (fp);
+    free (location);
+    return status;
+}
+
+/* Write the sessions captured since the last load or save. The file is replaced atomically,
+ * concurrent processes never read a partial store. */
+int
+OTHttpTicketsSave (const struct OTSessionContainer *const session)
+{
+    struct OTHttpTickets *ptr = (struct OTHttpTickets *)session->httpTickets;
+    struct OTHttpTicketsHeader header = { OTHTTP_TICKETS_MAGIC, OTHTTP_TICKETS_VERSION, 0 };
+    char *location = NULL;
+    char *temporary = NULL;
+    FILE *fp = NULL;
+    time_t now = time (NULL);
+    int fd, i;
+    int status = -1;
+
+    if (!ptr || !ptr->isSupported) return -1;
+    pthread_mutex_lock (&ptr->mutex);
+    if (!ptr->isChanged)
+        {
+            pthread_mutex_unlock (&ptr->mutex);
+            return 0;
+        }
+    location = OTHttpTicketsLocation (session);
+    if (!location) goto end;
+    temporary = malloc (strlen (location) + sizeof (".XXXXXX"));
+    if (!temporary) goto end;
+    sprintf (temporary, "%s.XXXXXX", location);
+    /* Created with mode 0600, the sessions contain the secrets to resume them. */
+    fd = mkstemp (temporary);
+    if (fd < 0) goto end;
+    fp = fdopen (fd, "wb");
+    if (!fp)
+        {
+            close (fd);
+            goto end;
+        }
+
+    for (i = 0; i < OTHTTP_TICKETS_HOSTS; i++)
+        if (ptr->entries[i].session && ptr->entries[i].expires > now) header.count++;
+    if (fwrite (&header, sizeof (header), 1, fp) != 1) goto end;
+    for (i = 0; i < OTHTTP_TICKETS_HOSTS; i++)
+        {
+            struct OTHttpTicket *entry = &ptr->entries[i];
+            struct OTHttpTicketRecord record;
+            if (!entry->session || entry->expires <= now) continue;
+            record.hostLength = strlen (entry->host);
+            record.sessionLength = entry->length;
+            record.expires = entry->expires;
+            if (fwrite (&record, sizeof (record), 1, fp) != 1
+                || fwrite (entry->host, record.hostLength, 1, fp) != 1
+                || fwrite (entry->session, entry->length, 1, fp) != 1)
+                goto end;
+        }
+    if (fclose (fp) != 0)
+        {
+            fp = NULL;
+            goto end;
+        }
+    fp = NULL;
+    if (rename (temporary, location) != 0) goto end;
+    ptr->isChanged = 0;
+    status = 0;
+end:
+    pthread_mutex_unlock (&ptr->mutex);
+    if (fp) fclose (fp);
+    if (status != 0 && temporary && temporary[0]) unlink (temporary);
+    free (temporary);
+    free (location);
+    return status;
+}
@@ -0,0 +1,288 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Access-token snapshots and single-flight token refresh
+ */
+
+#include <curl/curl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "OTHelper.h"
+#include "OTHttp.h"
+#include "OTJson.h"
+#include "openTIDAL.h"
+
+/* Tokens are refreshed this many seconds before they expire. */
+#define OTHTTP_TOKEN_MARGIN 300
+
+/* The published snapshot of a session. Readers take a reference without a lock: they
+ * announce themselves in one of two reader counts while loading the pointer. A writer that
+ * replaced the snapshot switches the readers to the other count and waits until no reader
+ * of the previous one is between loading the snapshot and taking its reference. Readers
+ * arriving meanwhile can not prolong the wait. Only writers, which rebuild or refresh the
+ * snapshot, take the mutex. */
+struct OTHttpTokens
+{
+    _Atomic (struct OTHttpToken *) current;
+    atomic_int readers[2];
+    atomic_int epoch;
+    /* Incremented by every published token. Snapshots of older generations are rebuilt. */
+    atomic_ulong generation;
+    /* Non-zero while a refresh is performed. Its end is signalled with refreshed. */
+    atomic_int isRefreshing;
+    pthread_mutex_t mutex;
+    pthread_cond_t refreshed;
+};
+
+void *
+OTHttpTokensCreate (void)
+{
+    struct OTHttpTokens *ptr = NULL;
+    ptr = malloc (sizeof (struct OTHttpTokens));
+    if (!ptr) return NULL;
+    if (pthread_mutex_init (&ptr->mutex, NULL) != 0)
+        {
+            free (ptr);
+            return NULL;
+        }
+    if (pthread_cond_init (&ptr->refreshed, NULL) != 0)
+        {
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+            return NULL;
+        }
+    atomic_init (&ptr->current, NULL);
+    atomic_init (&ptr->readers[0], 0);
+    atomic_init (&ptr->readers[1], 0);
+    atomic_init (&ptr->epoch, 0);
+    atomic_init (&ptr->generation, 0);
+    atomic_init (&ptr->isRefreshing, 0);
+    return ptr;
+}
+
+void
+OTHttpTokenRelease (struct OTHttpToken *const token)
+{
+    if (token && atomic_fetch_sub_explicit (&token->references, 1, memory_order_acq_rel) == 1)
+        {
+            curl_slist_free_all (token->list);
+            free (token);
+        }
+}
+
+void
+OTHttpTokensCleanup (void *tokens)
+{
+    struct OTHttpTokens *ptr = (struct OTHttpTokens *)tokens;
+    if (ptr)
+        {
+            OTHttpTokenRelease (atomic_load (&ptr->current));
+            pthread_cond_destroy (&ptr->refreshed);
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+        }
+}
+
+/* Build a snapshot of the current session values. Called with the mutex held. */
+static struct OTHttpToken *
+OTHttpTokenBuild (const struct OTSessionContainer *const session,
+                  const struct OTHttpTokens *const ptr)
+{
+    struct OTHttpToken *token = NULL;
+    char *authHeader = NULL;
+
+    if (session->verboseMode) fprintf (stderr, "* Rebuild authorisation header list\n");
+    if (!session->restrictedMode)
+        {
+            if (session->accessToken)
+                OTConcatenateString (&authHeader, "Authorization: Bearer %s",
+                                     session->accessToken);
+        }
+    else
+        OTConcatenateString (&authHeader, "X-Tidal-Token: %s", session->clientId);
+    if (!authHeader) return NULL;
+
+    token = malloc (sizeof (struct OTHttpToken));
+    if (token) token->list = curl_slist_append (NULL, authHeader);
+    free (authHeader);
+    if (!token || !token->list)
+        {
+            free (token);
+            return NULL;
+        }
+    /* The reference of the session. */
+    atomic_init (&token->references, 1);
+    token->source = session->accessToken;
+    token->clientId = session->clientId;
+    token->restrictedMode = session->restrictedMode;
+    token->expiresIn = session->expiresIn;
+    token->generation = atomic_load (&ptr->generation);
+    return token;
+}
+
+/* Replace the published snapshot and drop the reference of the session to the previous one
+ * once no reader can take a new reference to it. Called with the mutex held. */
+static void
+OTHttpTokenSwap (struct OTHttpTokens *const ptr, struct OTHttpToken *const token)
+{
+    struct OTHttpToken *previous = atomic_exchange (&ptr->current, token);
+    /* Readers switching to the new count load the new snapshot, so only the few readers
+     * already counted in the previous one are waited for. */
+    int epoch = atomic_fetch_xor (&ptr->epoch, 1);
+    while (atomic_load (&ptr->readers[epoch]) != 0)
+        sched_yield ();
+    OTHttpTokenRelease (previous);
+}
+
+static struct OTHttpToken *
+OTHttpTokenLoad (struct OTHttpTokens *const ptr)
+{
+    struct OTHttpToken *token = NULL;
+    int epoch = atomic_load (&ptr->epoch);
+    atomic_fetch_add (&ptr->readers[epoch], 1);
+    token = atomic_load (&ptr->current);
+    if (token) atomic_fetch_add_explicit (&token->references, 1, memory_order_relaxed);
+    atomic_fetch_sub (&ptr->readers[epoch], 1);
+    return token;
+}
+
+/* Non-zero if the snapshot was built from the current values of the session. A refreshed
+ * token may reuse the address of the freed previous one, so the generation is compared
+ * as well as the pointers of values set by the application. */
+static int
+OTHttpTokenIsCurrent (const struct OTSessionContainer *const session,
+                      const struct OTHttpTokens *const ptr, const struct OTHttpToken *const token)
+{
+    return token && token->generation == atomic_load (&ptr->generation)
+           && token->source == __atomic_load_n (&session->accessToken, __ATOMIC_ACQUIRE)
+           && token->clientId == session->clientId
+           && token->restrictedMode == session->restrictedMode;
+}
+
+/* Returns a reference to the snapshot of the session. The snapshot is rebuilt if the
+ * accessToken, the clientId or the restrictedMode was changed. Returns NULL if the
+ * authorisation header can not be created. Release the reference after the transfer. */
+struct OTHttpToken *
+OTHttpTokenAcquire (const struct OTSessionContainer *const session)
+{
+    struct OTHttpTokens *ptr = (struct OTHttpTokens *)session->httpHeaders;
+    struct OTHttpToken *token = NULL;
+    if (!ptr) return NULL;
+
+    token = OTHttpTokenLoad (ptr);
+    if (OTHttpTokenIsCurrent (session, ptr, token)) return token;
+    OTHttpTokenRelease (token);
+
+    pthread_mutex_lock (&ptr->mutex);
+    token = OTHttpTokenLoad (ptr);
+    if (!OTHttpTokenIsCurrent (session, ptr, token))
+        {
+            OTHttpTokenRelease (token);
+            token = OTHttpTokenBuild (session, ptr);
+            if (token)
+                {
+                    atomic_fetch_add_explicit (&token->references, 1, memory_order_relaxed);
+                    OTHttpTokenSwap (ptr, token);
+                }
+        }
+    pthread_mutex_unlock (&ptr->mutex);
+    return token;
+}
+
+/* Non-zero if the token of the snapshot has to be refreshed. */
+int
+OTHttpTokenIsExpiring (const struct OTHttpToken *const token)
+{
+    return !token->restrictedMode && time (NULL) + OTHTTP_TOKEN_MARGIN >= token->expiresIn;
+}
+
+/* Non-zero if the token of the snapshot can not be used anymore. */
+int
+OTHttpTokenIsExpired (const struct OTHttpToken *const token)
+{
+    return !token->restrictedMode && time (NULL) >= token->expiresIn;
+}
+
+/* Claim the refresh of the session token. Returns 0 if the caller performs the refresh,
+ * -1 if another thread is already refreshing. */
+int
+OTHttpTokenRefreshBegin (const struct OTSessionContainer *const session)
+{
+    struct OTHttpTokens *ptr = (struct OTHttpTokens *)session->httpHeaders;
+    if (!ptr) return 0;
+    return atomic_exchange (&ptr->isRefreshing, 1) ? -1 : 0;
+}
+
+void
+OTHttpTokenRefreshEnd (const struct OTSessionContainer *const session)
+{
+    struct OTHttpTokens *ptr = (struct OTHttpTokens *)session->httpHeaders;
+    if (!ptr) return;
+    pthread_mutex_lock (&ptr->mutex);
+    atomic_store (&ptr->isRefreshing, 0);
+    pthread_cond_broadcast (&ptr->refreshed);
+    pthread_mutex_unlock (&ptr->mutex);
+}
+
+/* Wait until the refresh performed by another thread has ended. */
+void
+OTHttpTokenRefreshWait (const struct OTSessionContainer *const session)
+{
+    struct OTHttpTokens *ptr = (struct OTHttpTokens *)session->httpHeaders;
+    if (!ptr) return;
+    pthread_mutex_lock (&ptr->mutex);
+    while (atomic_load (&ptr->isRefreshing))
+        pthread_cond_wait (&ptr->refreshed, &ptr->mutex);
+    pthread_mutex_unlock (&ptr->mutex);
+}
+
+/* Publish a refreshed token. The session takes ownership of renewalTree, which holds the
+ * accessToken string. The previous tree is freed after the session no longer points to
+ * it, snapshots of the previous token remain valid until their last reference is gone. */
+void
+OTHttpTokenPublish (struct OTSessionContainer *const session,
+                    struct OTJsonContainer *const renewalTree, char *const accessToken,
+                    const time_t expiresIn)
+{
+    struct OTHttpTokens *ptr = (struct OTHttpTokens *)session->httpHeaders;
+    struct OTJsonContainer *previous = session->renewalTree;
+    struct OTHttpToken *token = NULL;
+
+    if (ptr) pthread_mutex_lock (&ptr->mutex);
+    session->renewalTree = renewalTree;
+    session->expiresIn = expiresIn;
+    __atomic_store_n (&session->accessToken, accessToken, __ATOMIC_RELEASE);
+    if (ptr)
+        {
+            atomic_fetch_add (&ptr->generation, 1);
+            token = OTHttpTokenBuild (session, ptr);
+            /* Without a new snapshot the next reader rebuilds it. */
+            if (token) OTHttpTokenSwap (ptr, token);
+            pthread_mutex_unlock (&ptr->mutex);
+        }
+    OTJsonDelete (previous);
+}
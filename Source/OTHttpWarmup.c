@@ -0,0 +1,163 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* Connection warm-up
+ */
+
+#include <curl/curl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "OTHttp.h"
+#include "openTIDAL.h"
+
+/* Upper limit of the connections opened to baseUrl and the time the warm-up may take
+ * (milliseconds). */
+#define OTHTTP_WARMUP_CONNECTIONS 32
+#define OTHTTP_WARMUP_TIMEOUT 10000
+
+struct OTHttpWarmup
+{
+    struct OTSessionContainer *session;
+    int connections;
+};
+
+static size_t
+OTHttpWarmupDiscard (void *data, size_t size, size_t nmemb, void *userp)
+{
+    return size * nmemb;
+}
+
+/* Open the connections in parallel with a HEAD request each. The handles are attached to
+ * the session share, so the connections, the resolved addresses and the TLS sessions stay
+ * in its cache after the handles are gone and are reused by the main handle and every
+ * thread handle. Returns 0 if every connection was established, -1 otherwise. */
+static int
+OTHttpWarmupPerform (const struct OTSessionContainer *const session, int connections)
+{
+    struct OTHttpHandle *handles[OTHTTP_WARMUP_CONNECTIONS + 1];
+    CURLM *multi = NULL;
+    CURLMsg *msg = NULL;
+    int count = 0;
+    int established = 0;
+    int running = 0;
+    int queued = 0;
+    int i;
+
+    /* A multiplexed connection serves every handle. */
+    if (session->multiplexStreams) connections = 1;
+    if (connections > OTHTTP_WARMUP_CONNECTIONS) connections = OTHTTP_WARMUP_CONNECTIONS;
+    if (connections < 1) connections = 1;
+    multi = curl_multi_init ();
+    if (!multi) return -1;
+    if (session->multiplexStreams)
+        curl_multi_setopt (multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    /* One connection to authUrl, the others to baseUrl. */
+    for (i = 0; i <= connections; i++)
+        {
+            handles[count] = (struct OTHttpHandle *)OTHttpThreadHandleCreate ();
+            if (!handles[count]) break;
+            OTHttpShareAttach (session, handles[count]);
+            CURL *curl = handles[count]->curl;
+            curl_easy_setopt (curl, CURLOPT_URL, i < connections ? session->baseUrl
+                                                                 : session->authUrl);
+            curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
+            curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, OTHttpWarmupDiscard);
+            curl_easy_setopt (curl, CURLOPT_TIMEOUT_MS, (long)OTHTTP_WARMUP_TIMEOUT);
+            curl_easy_setopt (curl, CURLOPT_VERBOSE, session->verboseMode ? 1L : 0L);
+            if (session->multiplexStreams)
+                curl_easy_setopt (curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+            count += 1;
+            if (curl_multi_add_handle (multi, curl) != CURLM_OK) break;
+        }
+
+    do
+        {
+            if (curl_multi_perform (multi, &running) != CURLM_OK) break;
+            if (running && curl_multi_poll (multi, NULL, 0, 1000, NULL) != CURLM_OK) break;
+        }
+    while (running);
+    while ((msg = curl_multi_info_read (multi, &queued)))
+        if (msg->msg == CURLMSG_DONE && msg->data.result == CURLE_OK) established += 1;
+
+    for (i = 0; i < count; i++)
+        {
+            curl_multi_remove_handle (multi, handles[i]->curl);
+            OTHttpThreadHandleCleanup (handles[i]);
+        }
+    curl_multi_cleanup (multi);
+    if (session->verboseMode)
+        fprintf (stderr, "* Warm-up established %d of %d connections\n", established,
+                 connections + 1);
+    return established == connections + 1 ? 0 : -1;
+}
+
+static void *
+OTHttpWarmupRun (void *arg)
+{
+    struct OTHttpWarmup *warmup = (struct OTHttpWarmup *)arg;
+    OTHttpWarmupPerform (warmup->session, warmup->connections);
+    OTHttpRefreshEnd (warmup->session);
+    free (warmup);
+    return NULL;
+}
+
+/* Resolve baseUrl and authUrl and open connections to them before the first request.
+ * connections is the number of parallel connections to baseUrl, usually the number of
+ * handles performing requests at the same time. With isBackground the warm-up runs on a
+ * detached thread and the function returns immediately.
+ * Returns 0 if the connections were established (or the thread was started), -1 otherwise. */
+int
+OTSessionWarmup (struct OTSessionContainer *const session, const int connections,
+                 const int isBackground)
+{
+    struct OTHttpWarmup *warmup = NULL;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int isStarted = 0;
+
+    if (!isBackground) return OTHttpWarmupPerform (session, connections);
+
+    warmup = malloc (sizeof (struct OTHttpWarmup));
+    if (!warmup) return -1;
+    warmup->session = session;
+    warmup->connections = connections;
+    /* Session cleanup waits for the thread. */
+    if (OTHttpRefreshBegin (session) != 0)
+        {
+            free (warmup);
+            return -1;
+        }
+    if (pthread_attr_init (&attr) == 0)
+        {
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+            isStarted = pthread_create (&thread, &attr, OTHttpWarmupRun, warmup) == 0;
+            pthread_attr_destroy (&attr);
+        }
+    if (isStarted) return 0;
+    OTHttpRefreshEnd (session);
+    free (warmup);
+    return -1;
+}
@@ -1168,6 +1168,372 @@ OTJsonParse (const char *value)
     return OTJsonParseWithOpts (value, 0, 0);
 }
 
+/* Incremental parser. Structural characters are handled by a state machine with an explicit
+ * stack, scalar tokens are collected until they are complete and then parsed with the same
+ * functions as OTJsonParse. The tree is built while the input arrives. */
+enum OTJsonStreamState
+{
+    STREAM_VALUE,
+    STREAM_VALUE_OR_END,
+    STREAM_KEY,
+    STREAM_KEY_OR_END,
+    STREAM_COLON,
+    STREAM_COMMA_OR_END,
+    STREAM_DONE,
+    STREAM_ERROR
+};
+
+enum OTJsonStreamToken
+{
+    TOKEN_NONE,
+    TOKEN_STRING,
+    TOKEN_NUMBER,
+    TOKEN_LITERAL
+};
+
+struct OTJsonStreamFrame
+{
+    struct OTJsonContainer *item;
+    struct OTJsonContainer *tail;
+};
+
+struct OTJsonStream
+{
+    enum OTJsonStreamState state;
+    enum OTJsonStreamToken token;
+    int isEscaped;
+    int isKey;
+    unsigned char *buffer;
+    size_t length;
+    size_t capacity;
+    struct OTJsonStreamFrame *frames;
+    size_t depth;
+    size_t framesCapacity;
+    struct OTJsonContainer *root;
+    char *key;
+};
+
+struct OTJsonStream *
+OTJsonStreamCreate (void)
+{
+    struct OTJsonStream *stream = NULL;
+    stream = (struct OTJsonStream *)global_hooks.allocate (sizeof (struct OTJsonStream));
+    if (!stream) return NULL;
+    memset (stream, '\0', sizeof (struct OTJsonStream));
+    stream->state = STREAM_VALUE;
+    stream->token = TOKEN_NONE;
+    return stream;
+}
+
+void
+OTJsonStreamDelete (struct OTJsonStream *stream)
+{
+    if (stream)
+        {
+            OTJsonDelete (stream->root);
+            global_hooks.deallocate (stream->key);
+            global_hooks.deallocate (stream->buffer);
+            global_hooks.deallocate (stream->frames);
+            global_hooks.deallocate (stream);
+        }
+}
+
+static int
+OTJsonStreamAppend (struct OTJsonStream *const stream, const unsigned char c)
+{
+    unsigned char *ptr = NULL;
+    size_t capacity;
+    if (stream->length + 2 > stream->capacity)
+        {
+            capacity = stream->capacity ? stream->capacity * 2 : 64;
+            ptr = (unsigned char *)global_hooks.reallocate (stream->buffer, capacity);
+            if (!ptr) return false;
+            stream->buffer = ptr;
+            stream->capacity = capacity;
+        }
+    stream->buffer[stream->length++] = c;
+    stream->buffer[stream->length] = '\0';
+    return true;
+}
+
+/* Link a new item into the current container (or make it the root). */
+static int
+OTJsonStreamAttach (struct OTJsonStream *const stream, struct OTJsonContainer *const item)
+{
+    struct OTJsonStreamFrame *frame = NULL;
+    if (stream->depth == 0)
+        {
+            stream->root = item;
+            return true;
+        }
+    frame = &stream->frames[stream->depth - 1];
+    if (frame->item->type == OTJsonObject)
+        {
+            item->string = stream->key;
+            stream->key = NULL;
+        }
+    if (!frame->tail)
+        frame->item->child = item;
+    else
+        {
+            frame->tail->next = item;
+            item->prev = frame->tail;
+        }
+    frame->tail = item;
+    return true;
+}
+
+/* Open an array or an object. */
+static int
+OTJsonStreamPush (struct OTJsonStream *const stream, const int type)
+{
+    struct OTJsonContainer *item = NULL;
+    struct OTJsonStreamFrame *frames = NULL;
+    size_t capacity;
+    if (stream->depth >= CJSON_NESTING_LIMIT) return false;
+    if (stream->depth == stream->framesCapacity)
+        {
+            capacity = stream->framesCapacity ? stream->framesCapacity * 2 : 16;
+            frames = (struct OTJsonStreamFrame *)global_hooks.reallocate (
+                stream->frames, capacity * sizeof (struct OTJsonStreamFrame));
+            if (!frames) return false;
+            stream->frames = frames;
+            stream->framesCapacity = capacity;
+        }
+    item = OTJsonNew_Item (&global_hooks);
+    if (!item) return false;
+    item->type = type;
+    OTJsonStreamAttach (stream, item);
+    stream->frames[stream->depth].item = item;
+    stream->frames[stream->depth].tail = NULL;
+    stream->depth++;
+    stream->state = (type == OTJsonArray) ? STREAM_VALUE_OR_END : STREAM_KEY_OR_END;
+    return true;
+}
+
+/* Close the current array or object. */
+static int
+OTJsonStreamPop (struct OTJsonStream *const stream, const int type)
+{
+    struct OTJsonStreamFrame *frame = NULL;
+    if (stream->depth == 0) return false;
+    frame = &stream->frames[stream->depth - 1];
+    if (frame->item->type != type) return false;
+    if (frame->item->child) frame->item->child->prev = frame->tail;
+    stream->depth--;
+    stream->state = (stream->depth == 0) ? STREAM_DONE : STREAM_COMMA_OR_END;
+    return true;
+}
+
+/* Parse the collected scalar token and attach it. */
+static int
+OTJsonStreamToken (struct OTJsonStream *const stream)
+{
+    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 } };
+    struct OTJsonContainer *item = NULL;
+    enum OTJsonStreamToken token = stream->token;
+    int status = false;
+
+    stream->token = TOKEN_NONE;
+    buffer.content = stream->buffer;
+    buffer.length = stream->length;
+    buffer.hooks = global_hooks;
+    item = OTJsonNew_Item (&global_hooks);
+    if (!item) return false;
+
+    switch (token)
+        {
+        case TOKEN_STRING:
+            status = openTIDAL_ParseJsonString (item, &buffer);
+            break;
+        case TOKEN_NUMBER:
+            status = openTIDAL_ParseJsonNumber (item, &buffer);
+            break;
+        case TOKEN_LITERAL:
+            status = true;
+            if (strcmp ((const char *)stream->buffer, "null") == 0)
+                item->type = OTJsonNULL;
+            else if (strcmp ((const char *)stream->buffer, "false") == 0)
+                item->type = OTJsonFalse;
+            else if (strcmp ((const char *)stream->buffer, "true") == 0)
+                {
+                    item->type = OTJsonTrue;
+                    item->valueint = 1;
+                }
+            else
+                status = false;
+            buffer.offset = buffer.length;
+            break;
+        case TOKEN_NONE:
+            break;
+        }
+    stream->length = 0;
+    if (!status || buffer.offset != buffer.length)
+        {
+            OTJsonDelete (item);
+            return false;
+        }
+
+    if (stream->isKey)
+        {
+            /* swap valuestring and string, because we parsed the name */
+            stream->key = item->valuestring;
+            item->valuestring = NULL;
+            OTJsonDelete (item);
+            stream->state = STREAM_COLON;
+            return true;
+        }
+    OTJsonStreamAttach (stream, item);
+    stream->state = (stream->depth == 0) ? STREAM_DONE : STREAM_COMMA_OR_END;
+    return true;
+}
+
+static int
+OTJsonStreamBeginValue (struct OTJsonStream *const stream, const unsigned char c)
+{
+    stream->isKey = 0;
+    if (c == '{') return OTJsonStreamPush (stream, OTJsonObject);
+    if (c == '[') return OTJsonStreamPush (stream, OTJsonArray);
+    if (c == '\"')
+        stream->token = TOKEN_STRING;
+    else if (c == '-' || (c >= '0' && c <= '9'))
+        stream->token = TOKEN_NUMBER;
+    else if (c == 't' || c == 'f' || c == 'n')
+        stream->token = TOKEN_LITERAL;
+    else
+        return false;
+    stream->isEscaped = 0;
+    return OTJsonStreamAppend (stream, c);
+}
+
+/* Feed the next chunk of the input. Returns 0 if the input is valid so far. */
+int
+OTJsonStreamFeed (struct OTJsonStream *stream, const char *data, size_t length)
+{
+    const unsigned char *input = (const unsigned char *)data;
+    unsigned char c;
+    size_t i;
+    int status = true;
+
+    if (!stream || stream->state == STREAM_ERROR) return -1;
+    for (i = 0; i < length && status; i++)
+        {
+            c = input[i];
+            /* Collect scalar tokens. */
+            if (stream->token == TOKEN_STRING)
+                {
+                    status = OTJsonStreamAppend (stream, c);
+                    if (stream->isEscaped)
+                        stream->isEscaped = 0;
+                    else if (c == '\\')
+                        stream->isEscaped = 1;
+                    else if (c == '\"')
+                        status = status && OTJsonStreamToken (stream);
+                    continue;
+                }
+            if (stream->token == TOKEN_NUMBER)
+                {
+                    if ((c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.' || c == 'e'
+                        || c == 'E')
+                        {
+                            status = OTJsonStreamAppend (stream, c);
+                            continue;
+                        }
+                    if (!OTJsonStreamToken (stream))
+                        {
+                            status = false;
+                            continue;
+                        }
+                }
+            if (stream->token == TOKEN_LITERAL)
+                {
+                    if (c >= 'a' && c <= 'z')
+                        {
+                            status = OTJsonStreamAppend (stream, c);
+                            continue;
+                        }
+                    if (!OTJsonStreamToken (stream))
+                        {
+                            status = false;
+                            continue;
+                        }
+                }
+            /* Garbage after the root is ignored like in OTJsonParse. */
+            if (stream->state == STREAM_DONE) break;
+            if (c == ' ' || c == '\t' || c == '\n' || c == '\r') continue;
+
+            switch (stream->state)
+                {
+                case STREAM_VALUE_OR_END:
+                    if (c == ']')
+                        {
+                            status = OTJsonStreamPop (stream, OTJsonArray);
+                            break;
+                        }
+                    /* fall through */
+                case STREAM_VALUE:
+                    status = OTJsonStreamBeginValue (stream, c);
+                    break;
+                case STREAM_KEY_OR_END:
+                    if (c == '}')
+                        {
+                            status = OTJsonStreamPop (stream, OTJsonObject);
+                            break;
+                        }
+                    /* fall through */
+                case STREAM_KEY:
+                    status = (c == '\"') && OTJsonStreamBeginValue (stream, c);
+                    stream->isKey = 1;
+                    break;
+                case STREAM_COLON:
+                    status = (c == ':');
+                    stream->state = STREAM_VALUE;
+                    break;
+                case STREAM_COMMA_OR_END:
+                    if (c == ',')
+                        stream->state
+                            = (stream->frames[stream->depth - 1].item->type == OTJsonObject)
+                                  ? STREAM_KEY
+                                  : STREAM_VALUE;
+                    else if (c == ']')
+                        status = OTJsonStreamPop (stream, OTJsonArray);
+                    else if (c == '}')
+                        status = OTJsonStreamPop (stream, OTJsonObject);
+                    else
+                        status = false;
+                    break;
+                case STREAM_DONE:
+                case STREAM_ERROR:
+                    break;
+                }
+        }
+    if (!status)
+        {
+            stream->state = STREAM_ERROR;
+            return -1;
+        }
+    return 0;
+}
+
+/* Finish the input and return the parsed tree. Returns NULL if the input was incomplete or
+ * invalid. The stream is deallocated. */
+struct OTJsonContainer *
+OTJsonStreamFinish (struct OTJsonStream *stream)
+{
+    struct OTJsonContainer *root = NULL;
+    if (!stream) return NULL;
+    /* A number at the end of the input has no terminating character. */
+    if (stream->token != TOKEN_NONE && stream->state != STREAM_ERROR)
+        if (!OTJsonStreamToken (stream)) stream->state = STREAM_ERROR;
+    if (stream->state == STREAM_DONE)
+        {
+            root = stream->root;
+            stream->root = NULL;
+        }
+    OTJsonStreamDelete (stream);
+    return root;
+}
+
 #define cjson_min(a, b) (((a) < (b)) ? (a) : (b))
 
 static unsigned char *
@@ -2788,6 +3154,15 @@ OTJsonDuplicate (const struct OTJsonContainer *item, int recurse)
     newitem->type = item->type & (~OTJsonIsReference);
     newitem->valueint = item->valueint;
     newitem->valuedouble = item->valuedouble;
+    if (item->valueintstring)
+        {
+            newitem->valueintstring
+                = (char *)OTJsonstrdup ((unsigned char *)item->valueintstring, &global_hooks);
+            if (!newitem->valueintstring)
+                {
+                    goto fail;
+                }
+        }
     if (item->valuestring)
         {
             newitem->valuestring
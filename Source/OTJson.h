@@ -86,6 +86,13 @@ struct OTJsonContainer *OTJsonParseWithOpts (const char *value, const char **ret
 struct OTJsonContainer *OTJsonParseWithLengthOpts (const char *value, size_t buffer_length,
                                                    const char **return_parse_end,
                                                    int require_null_terminated);
+/* Incremental parsing: feed the JSON in arbitrary chunks, OTJsonStreamFinish returns the tree
+ * (or NULL if the input was invalid or incomplete) and deallocates the stream. */
+struct OTJsonStream;
+struct OTJsonStream *OTJsonStreamCreate (void);
+int OTJsonStreamFeed (struct OTJsonStream *stream, const char *data, size_t length);
+struct OTJsonContainer *OTJsonStreamFinish (struct OTJsonStream *stream);
+void OTJsonStreamDelete (struct OTJsonStream *stream);
 
 /* Render a struct OTJsonContainer entity to text for transfer/storage. */
 char *OTJsonPrint (const struct OTJsonContainer *item);
@@ -0,0 +1,198 @@
+/*
+    Copyright (c) 2020-2021 Hugo Melder and openTIDAL contributors
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/* openTIDAL negative cache
+ * Remembers artefacts which do not exist in a countryCode, so repeated lookups of the
+ * same ids are answered without a request. Only 64-bit hashes of the keys are stored.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "OTHelper.h"
+#include "OTHttp.h"
+#include "OTJson.h"
+#include "openTIDAL.h"
+
+/* Slots inspected for a key before the one expiring first is replaced. */
+#define OTNEGATIVECACHE_PROBES 8
+
+struct OTNegativeCacheSlot
+{
+    /* 0 if the slot is empty. */
+    uint64_t hash;
+    long long expires;
+    long responseCode;
+};
+
+struct OTNegativeCacheContainer
+{
+    pthread_mutex_t mutex;
+    long long ttl;
+    size_t mask;
+    struct OTNegativeCacheSlot *slots;
+};
+
+/* Allocate a negative cache for at least the number of entries. Entries expire after the
+ * time to live in seconds. */
+void *
+OTNegativeCacheCreate (const size_t entries, const long ttl)
+{
+    struct OTNegativeCacheContainer *cache = NULL;
+    size_t slots = 64;
+    while (slots < entries)
+        slots *= 2;
+    cache = malloc (sizeof (struct OTNegativeCacheContainer));
+    if (!cache) return NULL;
+    cache->slots = calloc (slots, sizeof (struct OTNegativeCacheSlot));
+    if (!cache->slots || pthread_mutex_init (&cache->mutex, NULL) != 0)
+        {
+            free (cache->slots);
+            free (cache);
+            return NULL;
+        }
+    cache->ttl = (long long)ttl * 1000;
+    cache->mask = slots - 1;
+    return cache;
+}
+
+void
+OTNegativeCacheCleanup (void *negativeCache)
+{
+    struct OTNegativeCacheContainer *cache = (struct OTNegativeCacheContainer *)negativeCache;
+    if (!cache) return;
+    pthread_mutex_destroy (&cache->mutex);
+    free (cache->slots);
+    free (cache);
+}
+
+/* Attach a negative cache to a session. NULL detaches it. The cache must outlive the
+ * session. */
+void
+OTSessionNegativeCache (struct OTSessionContainer *const session, void *negativeCache)
+{
+    session->negativeCache = negativeCache;
+}
+
+/* Hash the countryCode, the endpoint and the parameters of the request with 64-bit FNV-1a.
+ * A missing sub-resource ("/v1/artists/1/bio") does not hide its artefact or siblings.
+ * Returns 0 if the request does not name an artefact. */
+static uint64_t
+OTNegativeCacheHash (const struct OTSessionContainer *const session,
+                     const struct OTHttpContainer *const http)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const char *c = NULL;
+    if (!http->isArtefact || !http->endpoint || !session->countryCode) return 0;
+    for (c = session->countryCode; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    for (c = http->endpoint; *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    hash = (hash ^ (unsigned char)'?') * 1099511628211ULL;
+    for (c = http->parameter; c && *c; c++)
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    return hash ? hash : 1;
+}
+
+/* Answer a request for a missing artefact from the cache. The OTHttpContainer is filled
+ * as if the request was performed. Returns 1 on a hit, 0 otherwise. */
+int
+OTNegativeCacheLookup (const struct OTSessionContainer *const session,
+                       struct OTHttpContainer *const http)
+{
+    struct OTNegativeCacheContainer *cache
+        = (struct OTNegativeCacheContainer *)session->negativeCache;
+    struct OTNegativeCacheSlot *slot = NULL;
+    char body[64];
+    long responseCode = 0;
+    long long now;
+    uint64_t hash;
+    size_t i;
+
+    if (!cache) return 0;
+    hash = OTNegativeCacheHash (session, http);
+    if (!hash) return 0;
+
+    pthread_mutex_lock (&cache->mutex);
+    now = OTHttpTime ();
+    for (i = 0; i < OTNEGATIVECACHE_PROBES; i++)
+        {
+            slot = &cache->slots[(hash + i) & cache->mask];
+            if (slot->hash != hash) continue;
+            if (slot->expires > now)
+                responseCode = slot->responseCode;
+            else
+                slot->hash = 0;
+            break;
+        }
+    pthread_mutex_unlock (&cache->mutex);
+    if (!responseCode) return 0;
+
+    /* The error body of the API without the messages. */
+    snprintf (body, sizeof (body), "{\"status\":%ld}", responseCode);
+    http->tree = OTJsonParse (body);
+    if (!http->tree) return 0;
+    if (session->verboseMode) fprintf (stderr, "* Negative cache hit %s\n", http->endpoint);
+    http->httpOk = 0;
+    http->responseCode = responseCode;
+    http->isStreamParsed = 1;
+    OTHttpMetricsNegative (session, 1);
+    return 1;
+}
+
+/* Remember an artefact that was not found. */
+void
+OTNegativeCacheStore (const struct OTSessionContainer *const session,
+                      const struct OTHttpContainer *const http)
+{
+    struct OTNegativeCacheContainer *cache
+        = (struct OTNegativeCacheContainer *)session->negativeCache;
+    struct OTNegativeCacheSlot *slot = NULL;
+    struct OTNegativeCacheSlot *victim = NULL;
+    uint64_t hash;
+    size_t i;
+
+    if (!cache || http->httpOk != 0) return;
+    if (http->responseCode != 404 && http->responseCode != 451) return;
+    hash = OTNegativeCacheHash (session, http);
+    if (!hash) return;
+
+    pthread_mutex_lock (&cache->mutex);
+    for (i = 0; i < OTNEGATIVECACHE_PROBES; i++)
+        {
+            slot = &cache->slots[(hash + i) & cache->mask];
+            if (slot->hash == hash || slot->hash == 0)
+                {
+                    victim = slot;
+                    break;
+                }
+            if (!victim || slot->expires < victim->expires) victim = slot;
+        }
+    victim->hash = hash;
+    victim->expires = OTHttpTime () + cache->ttl;
+    victim->responseCode = http->responseCode;
+    pthread_mutex_unlock (&cache->mutex);
+    OTHttpMetricsNegative (session, 0);
+}
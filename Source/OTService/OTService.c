@@ -31,9 +31,30 @@
 #include "../OTJson.h"
 #include "../openTIDAL.h"
 
-struct OTContentContainer *
-OTServiceRequestStandard (struct OTSessionContainer *session, struct OTHttpContainer *http,
-                          void *threadHandle)
+/* Use the threadHandle if not NULL. */
+static void
+OTServiceSelectHandle (struct OTSessionContainer *session, struct OTHttpContainer *http,
+                       void *threadHandle)
+{
+    if (threadHandle)
+        http->handle = threadHandle;
+    else
+        http->handle = session->mainHttpHandle;
+}
+
+/* Return the incrementally parsed tree or parse the buffered response. */
+static struct OTJsonContainer *
+OTServiceParseResponse (struct OTHttpContainer *http)
+{
+    struct OTJsonContainer *tree = http->tree;
+    http->tree = NULL;
+    if (!http->isStreamParsed) tree = OTJsonParse (http->response);
+    return tree;
+}
+
+/* Parse a finished request into an OTContentContainer. */
+static void *
+OTServiceFinishStandard (struct OTHttpContainer *http, enum OTStatus *status)
 {
     int isException = 0;
     struct OTContentContainer *content;
@@ -42,20 +63,19 @@ OTServiceRequestStandard (struct OTSessionContainer *session, struct OTHttpConta
     /* Allocate OTContentContainer. Needs to be freed after use! */
     content = OTAllocContainer (containerType);
     if (!content)
-        return NULL;
+        {
+            isException = 1;
+            goto end;
+        }
     content->tree = NULL;
-    /* Use the threadHandle if not NULL. */
-    if (threadHandle)
-        http->handle = threadHandle;
-    else
-        http->handle = session->mainHttpHandle;
-
-    /* Perform http request. */
-    OTHttpRequest (session, http);
+    content->responseBytes = http->responseBytes;
+    content->wireBytes = http->wireBytes;
+    OTHttpHeadersMove (http, &content->headers);
     if (http->httpOk != -1)
         {
             content->status = OTHttpParseStatus (http);
-            content->tree = OTJsonParse (http->response);
+            if (http->isOffline) content->status = STALE_OFFLINE;
+            content->tree = OTServiceParseResponse (http);
             if (!content->tree)
                 {
                     isException = 1;
@@ -63,20 +83,33 @@ OTServiceRequestStandard (struct OTSessionContainer *session, struct OTHttpConta
                 }
         }
     else
-        content->status = CURL_NOT_OK;
+        content->status = OTHttpTransportStatus (http);
 end:
     free (http->response);
+    free (http->entityTag);
+    free (http->staleEntityTag);
+    OTHttpHeadersClear (&http->headers);
+    OTJsonDelete (http->tree);
+    OTJsonDelete (http->staleTree);
+    http->response = NULL;
+    http->entityTag = NULL;
+    http->staleEntityTag = NULL;
+    http->tree = NULL;
+    http->staleTree = NULL;
     if (isException)
         {
+            if (content) OTHttpHeadersClear (&content->headers);
             free (content);
+            *status = MALLOC_ERROR;
             return NULL;
         }
+    *status = content->status;
     return content;
 }
 
-struct OTContentStreamContainer *
-OTServiceRequestStream (struct OTSessionContainer *session, struct OTHttpContainer *http,
-                        void *threadHandle)
+/* Parse a finished request into an OTContentStreamContainer and decode the manifest. */
+static void *
+OTServiceFinishStream (struct OTHttpContainer *http, enum OTStatus *status)
 {
     int isException = 0;
     struct OTContentStreamContainer *content;
@@ -90,21 +123,19 @@ OTServiceRequestStream (struct OTSessionContainer *session, struct OTHttpContain
     /* Allocate OTContentContainer. Needs to be freed after use! */
     content = OTAllocContainer (containerType);
     if (!content)
-        return NULL;
+        {
+            isException = 1;
+            goto end;
+        }
     content->manifest = NULL;
     content->tree = NULL;
-    /* Use the threadHandle if not NULL. */
-    if (threadHandle)
-        http->handle = threadHandle;
-    else
-        http->handle = session->mainHttpHandle;
-
-    /* Perform http request. */
-    OTHttpRequest (session, http);
+    content->responseBytes = http->responseBytes;
+    content->wireBytes = http->wireBytes;
+    OTHttpHeadersMove (http, &content->headers);
     if (http->httpOk != -1)
         {
             content->status = OTHttpParseStatus (http);
-            content->tree = OTJsonParse (http->response);
+            content->tree = OTServiceParseResponse (http);
             if (!content->tree)
                 {
                     isException = 1;
@@ -140,31 +171,150 @@ OTServiceRequestStream (struct OTSessionContainer *session, struct OTHttpContain
                 }
         }
     else
-        content->status = CURL_NOT_OK;
+        content->status = OTHttpTransportStatus (http);
 end:
     free (http->response);
+    free (http->entityTag);
+    free (http->staleEntityTag);
+    OTHttpHeadersClear (&http->headers);
+    OTJsonDelete (http->tree);
+    OTJsonDelete (http->staleTree);
+    http->response = NULL;
+    http->entityTag = NULL;
+    http->staleEntityTag = NULL;
+    http->tree = NULL;
+    http->staleTree = NULL;
     if (isException)
         {
+            if (content)
+                {
+                    OTJsonDelete (content->tree);
+                    OTHttpHeadersClear (&content->headers);
+                }
             free (content);
+            *status = MALLOC_ERROR;
             return NULL;
         }
+    *status = content->status;
     return content;
 }
 
+/* Asynchronous requests only return the status. */
+static void *
+OTServiceFinishSilent (struct OTHttpContainer *http, enum OTStatus *status)
+{
+    if (http->httpOk != -1)
+        *status = OTHttpParseStatus (http);
+    else
+        *status = OTHttpTransportStatus (http);
+    free (http->response);
+    free (http->entityTag);
+    OTHttpHeadersClear (&http->headers);
+    http->response = NULL;
+    http->entityTag = NULL;
+    return NULL;
+}
+
+/* Update the caches with a performed request. */
+static void
+OTServiceStoreStandard (const struct OTSessionContainer *const session,
+                        struct OTHttpContainer *const http)
+{
+    OTCacheRevalidate (session, http);
+    OTCacheFallback (session, http);
+    OTCacheStore (session, http);
+    OTDiskCacheStore (session, http);
+    OTNegativeCacheStore (session, http);
+}
+
+struct OTContentContainer *
+OTServiceRequestStandard (struct OTSessionContainer *session, struct OTHttpContainer *http,
+                          void *threadHandle)
+{
+    enum OTStatus status = UNKNOWN;
+    struct OTHttpFlight *flight = NULL;
+    int isHit = 0;
+    OTServiceSelectHandle (session, http, threadHandle);
+    http->isStreamParsed = 1;
+
+    /* A cache hit skips the request and the parsing. An expired entry with an entity-tag
+     * is revalidated by the request. */
+    if (OTNegativeCacheLookup (session, http) || OTCacheLookup (session, http))
+        isHit = 1;
+    else if (OTDiskCacheLookup (session, http))
+        {
+            OTCacheStore (session, http);
+            isHit = 1;
+        }
+    /* Asynchronous requests do not join the flights of other threads, the engine must not
+     * block. */
+    if (http->handle && http->handle->asyncRequest)
+        {
+            if (isHit)
+                OTAsyncResolve (session, http, CONTENT_CONTAINER, OTServiceFinishStandard);
+            else
+                OTAsyncSubmit (session, http, CONTENT_CONTAINER, OTServiceFinishStandard,
+                               OTServiceStoreStandard);
+            return NULL;
+        }
+    if (isHit) return OTServiceFinishStandard (http, &status);
+
+    /* Perform http request. Identical GET requests of other threads share the result. */
+    if (OTHttpFlightJoin (session, http, &flight) == 0)
+        {
+            OTHttpRequest (session, http);
+            OTServiceStoreStandard (session, http);
+            OTHttpFlightLeave (session, flight, http);
+        }
+    return OTServiceFinishStandard (http, &status);
+}
+
+/* Remember a missing artefact. */
+static void
+OTServiceStoreStream (const struct OTSessionContainer *const session,
+                      struct OTHttpContainer *const http)
+{
+    OTNegativeCacheStore (session, http);
+}
+
+struct OTContentStreamContainer *
+OTServiceRequestStream (struct OTSessionContainer *session, struct OTHttpContainer *http,
+                        void *threadHandle)
+{
+    enum OTStatus status = UNKNOWN;
+    int isHit;
+    OTServiceSelectHandle (session, http, threadHandle);
+    http->isStreamParsed = 1;
+
+    /* Perform http request. Missing artefacts are answered by the negative cache. */
+    isHit = OTNegativeCacheLookup (session, http);
+    if (http->handle && http->handle->asyncRequest)
+        {
+            if (isHit)
+                OTAsyncResolve (session, http, CONTENT_STREAM_CONTAINER, OTServiceFinishStream);
+            else
+                OTAsyncSubmit (session, http, CONTENT_STREAM_CONTAINER, OTServiceFinishStream,
+                               OTServiceStoreStream);
+            return NULL;
+        }
+    if (isHit) return OTServiceFinishStream (http, &status);
+    OTHttpRequest (session, http);
+    OTServiceStoreStream (session, http);
+    return OTServiceFinishStream (http, &status);
+}
+
 /* Free http response after use. */
 enum OTStatus
 OTServiceRequestSilent (struct OTSessionContainer *session, struct OTHttpContainer *http,
                         void *threadHandle)
 {
-    int isException = 0;
     enum OTStatus status = UNKNOWN;
-    enum OTTypes containerType = CONTENT_CONTAINER;
-
-    /* Use the threadHandle if not NULL. */
-    if (threadHandle)
-        http->handle = threadHandle;
-    else
-        http->handle = session->mainHttpHandle;
+    OTServiceSelectHandle (session, http, threadHandle);
+    if (http->handle && http->handle->asyncRequest)
+        {
+            OTAsyncSubmit (session, http, CONTENT_CONTAINER, OTServiceFinishSilent, NULL);
+            return REQUEST_PENDING;
+        }
 
     /* Perform http request. */
     OTHttpRequest (session, http);
@@ -173,7 +323,13 @@ OTServiceRequestSilent (struct OTSessionContainer *session, struct OTHttpContain
             status = OTHttpParseStatus (http);
         }
     else
-        status = CURL_NOT_OK;
+        status = OTHttpTransportStatus (http);
+    /* Only headers requested by the caller are kept. */
+    if (!(http->headerMask & HEADER_ENTITY_TAG))
+        {
+            free (http->entityTag);
+            http->entityTag = NULL;
+        }
+    OTHttpHeadersClear (&http->headers);
     return status;
 }
-
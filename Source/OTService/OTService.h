@@ -33,4 +33,6 @@ struct OTContentStreamContainer *OTServiceRequestStream (struct OTSessionContain
                                                          void *threadHandle);
 enum OTStatus OTServiceRequestSilent (struct OTSessionContainer *session,
                                       struct OTHttpContainer *http, void *threadHandle);
+void *OTServicePlaylistTagsCreate (void);
+void OTServicePlaylistTagsCleanup (void *tags);
 #endif /* OTSERVICE__h */
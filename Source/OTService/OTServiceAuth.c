@@ -37,17 +37,20 @@ OTServiceGetDeviceCode (struct OTSessionContainer *session, void *threadHandle)
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer postData;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = POST;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
     http.endpoint = "/v1/oauth2/device_authorization";
     http.type = &reqType;
     http.isAuthRequest = 1;
     if (session->clientId)
-        OTConcatenateString (&http.postData, "client_id=%s&scope=%s", session->clientId,
-                             session->scopes);
+        OTUrlExpand (&postData, "client_id=%s&scope=%s", session->clientId, session->scopes);
+    http.postData = OTUrlString (&postData);
     if (!http.postData)
         {
             isException = 1;
@@ -56,7 +59,7 @@ OTServiceGetDeviceCode (struct OTSessionContainer *session, void *threadHandle)
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.postData);
+    OTUrlFree (&postData);
     return content;
 }
 
@@ -67,18 +70,22 @@ OTServiceGetBearerToken (struct OTSessionContainer *session, const char *const d
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer postData;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = POST;
     const char *grant_type = "urn:ietf:params:oauth:grant-type:device_code";
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
     http.endpoint = "/v1/oauth2/token";
     http.type = &reqType;
     http.isAuthRequest = 1;
     if (session->clientId)
-        OTConcatenateString (&http.postData, "client_id=%s&scope=%s&grant_type=%s&device_code=%s",
-                             session->clientId, session->scopes, grant_type, deviceCode);
+        OTUrlExpand (&postData, "client_id=%s&scope=%s&grant_type=%s&device_code=%s",
+                     session->clientId, session->scopes, grant_type, deviceCode);
+    http.postData = OTUrlString (&postData);
     if (!http.postData)
         {
             isException = 1;
@@ -87,7 +94,7 @@ OTServiceGetBearerToken (struct OTSessionContainer *session, const char *const d
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.postData);
+    OTUrlFree (&postData);
     return content;
 }
 
@@ -98,18 +105,22 @@ OTServiceRefreshBearerToken (struct OTSessionContainer *session, const char *con
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer postData;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = POST;
     const char *grant_type = "refresh_token";
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
     http.endpoint = "/v1/oauth2/token";
     http.type = &reqType;
     http.isAuthRequest = 1;
     if (session->clientId)
-        OTConcatenateString (&http.postData, "client_id=%s&scope=%s&grant_type=%s&refresh_token=%s",
-                             session->clientId, session->scopes, grant_type, refreshToken);
+        OTUrlExpand (&postData, "client_id=%s&scope=%s&grant_type=%s&refresh_token=%s",
+                     session->clientId, session->scopes, grant_type, refreshToken);
+    http.postData = OTUrlString (&postData);
     if (!http.postData)
         {
             isException = 1;
@@ -118,7 +129,7 @@ OTServiceRefreshBearerToken (struct OTSessionContainer *session, const char *con
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.postData);
+    OTUrlFree (&postData);
     return content;
 }
 
@@ -60,11 +60,17 @@ OTServiceGetFavorites (struct OTSessionContainer *session, const char *const suf
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = GET;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
 
     if (session->restrictedMode)
         {
@@ -76,18 +82,20 @@ OTServiceGetFavorites (struct OTSessionContainer *session, const char *const suf
 
     /* Favorite mixes are in v2. */
     if (strcmp (suffix, "mixes") == 0)
-        OTConcatenateString (&http.endpoint, "/v2/favorites/%s", suffix);
+        OTUrlExpand (&endpoint, "/v2/favorites/%s", suffix);
     else if (strcmp (suffix, "playlists") == 0)
-        OTConcatenateString (&http.endpoint, "/v1/users/%s/favorites/playlistsAndFavoritePlaylists",
-                             session->userId);
+        OTUrlExpand (&endpoint, "/v1/users/%s/favorites/playlistsAndFavoritePlaylists",
+                     session->userId);
     else
-        OTConcatenateString (&http.endpoint, "/v1/users/%s/favorites/%s", session->userId, suffix);
-    OTConcatenateString (&http.parameter,
-                         "countryCode=%s&limit=%d&offset=%d&order=%s&orderDirection=%s&"
-                         "locale=%s&deviceType=%s",
-                         session->countryCode, limit, offset, order, orderDirection,
-                         session->locale, session->deviceType);
-
+        OTUrlExpand (&endpoint, "/v1/users/%s/favorites/%s", session->userId, suffix);
+    OTUrlExpand (&parameter,
+                 "countryCode=%s&limit=%d&offset=%d&order=%s&orderDirection=%s&"
+                 "locale=%s&deviceType=%s",
+                 session->countryCode, limit, offset, order, orderDirection,
+                 session->locale, session->deviceType);
+
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter || !http.endpoint)
         {
             isException = 1;
@@ -96,8 +104,8 @@ OTServiceGetFavorites (struct OTSessionContainer *session, const char *const suf
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     return content;
 }
 
@@ -107,11 +115,17 @@ OTServiceDeleteFavorite (struct OTSessionContainer *session, const char *const s
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     enum OTHttpTypes reqType = DELETE;
     enum OTStatus status = UNKNOWN;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
 
     if (session->restrictedMode)
         return status;
@@ -122,18 +136,18 @@ OTServiceDeleteFavorite (struct OTSessionContainer *session, const char *const s
     /* Use v2 if suffix is equal to "mixes". */
     if (!(strcmp (suffix, "mixes") == 0))
         {
-            OTConcatenateString (&http.endpoint, "/v1/users/%s/favorites/%s/%s", session->userId,
-                                 suffix, id);
-            OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
+            OTUrlExpand (&endpoint, "/v1/users/%s/favorites/%s/%s", session->userId, suffix, id);
+            OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
         }
     else
         {
             reqType = PUT;
-            OTConcatenateString (&http.endpoint, "/v2/favorites/%s/remove", suffix);
-            OTConcatenateString (&http.parameter, "mixIds=%s&countryCode=%s", id,
-                                 session->countryCode);
+            OTUrlExpand (&endpoint, "/v2/favorites/%s/remove", suffix);
+            OTUrlExpand (&parameter, "mixIds=%s&countryCode=%s", id, session->countryCode);
         }
 
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter || !http.endpoint)
         {
             isException = 1;
@@ -142,8 +156,8 @@ OTServiceDeleteFavorite (struct OTSessionContainer *session, const char *const s
 
     status = OTServiceRequestSilent (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     return status;
 }
 
@@ -153,12 +167,21 @@ OTServiceAddFavorite (struct OTSessionContainer *session, const char *const suff
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
+    struct OTUrlBuffer postData;
     const char *type;
     enum OTHttpTypes reqType = POST;
     enum OTStatus status = UNKNOWN;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
 
     if (session->restrictedMode)
         return status;
@@ -176,16 +199,18 @@ OTServiceAddFavorite (struct OTSessionContainer *session, const char *const suff
 
     /* Use v2 if suffix is equal to "mixes". */
     if (!(strcmp (suffix, "mixes") == 0))
-        OTConcatenateString (&http.endpoint, "/v1/users/%s/favorites/%s", session->userId, suffix);
+        OTUrlExpand (&endpoint, "/v1/users/%s/favorites/%s", session->userId, suffix);
     else
         {
             reqType = PUT;
-            OTConcatenateString (&http.endpoint, "/v2/favorites/%s/add", suffix);
+            OTUrlExpand (&endpoint, "/v2/favorites/%s/add", suffix);
         }
 
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
-    OTConcatenateString (&http.postData, "%s=%s&onArtifactNotFound=%s", type, itemId,
-                         onArtifactNotFound);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    OTUrlExpand (&postData, "%s=%s&onArtifactNotFound=%s", type, itemId, onArtifactNotFound);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
+    http.postData = OTUrlString (&postData);
     if (!http.parameter || !http.endpoint || !http.postData)
         {
             isException = 1;
@@ -194,9 +219,9 @@ OTServiceAddFavorite (struct OTSessionContainer *session, const char *const suff
 
     status = OTServiceRequestSilent (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (http.postData);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
+    OTUrlFree (&postData);
     return status;
 }
 
@@ -207,13 +232,22 @@ OTServiceAddFavorites (struct OTSessionContainer *session, const char *const suf
 {
     int isException = 0;
     struct OTHttpContainer http;
-    char *arrayString;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
+    struct OTUrlBuffer postData;
     const char *type;
+    int i;
     enum OTHttpTypes reqType = POST;
     enum OTStatus status = UNKNOWN;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
 
     if (session->restrictedMode)
         return status;
@@ -221,13 +255,6 @@ OTServiceAddFavorites (struct OTSessionContainer *session, const char *const suf
     http.type = &reqType;
     http.isDummy = 1;
 
-    OTArrayToString (&arrayString, itemIds, size);
-    if (!arrayString)
-        {
-            isException = 1;
-            goto end;
-        }
-
     /* Determine type of artefact to add. */
     type = OTServiceFavoriteType (suffix);
     if (!type)
@@ -238,16 +265,25 @@ OTServiceAddFavorites (struct OTSessionContainer *session, const char *const suf
 
     /* Use v2 if suffix is equal to "mixes". */
     if (!(strcmp (suffix, "mixes") == 0))
-        OTConcatenateString (&http.endpoint, "/v1/users/%s/favorites/%s", session->userId, suffix);
+        OTUrlExpand (&endpoint, "/v1/users/%s/favorites/%s", session->userId, suffix);
     else
         {
             reqType = PUT;
-            OTConcatenateString (&http.endpoint, "/v2/favorites/%s/add", suffix);
+            OTUrlExpand (&endpoint, "/v2/favorites/%s/add", suffix);
         }
 
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
-    OTConcatenateString (&http.postData, "%s=%s&onArtifactNotFound=%s", type, arrayString,
-                         onArtifactNotFound);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    OTUrlExpand (&postData, "%s=", type);
+    for (i = 0; i < size; i++)
+        {
+            if (i)
+                OTUrlAppend (&postData, ", ");
+            OTUrlAppend (&postData, itemIds[i]);
+        }
+    OTUrlExpand (&postData, "&onArtifactNotFound=%s", onArtifactNotFound);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
+    http.postData = OTUrlString (&postData);
     if (!http.parameter || !http.endpoint || !http.postData)
         {
             isException = 1;
@@ -256,8 +292,8 @@ OTServiceAddFavorites (struct OTSessionContainer *session, const char *const suf
 
     status = OTServiceRequestSilent (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (http.postData);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
+    OTUrlFree (&postData);
     return status;
 }
@@ -36,11 +36,14 @@ OTServiceGetFeedActivities (struct OTSessionContainer *session, void *threadHand
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer parameter;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = GET;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
 
     if (session->restrictedMode)
         {
@@ -50,8 +53,9 @@ OTServiceGetFeedActivities (struct OTSessionContainer *session, void *threadHand
 
     http.type = &reqType;
     http.endpoint = "/v2/feed/activities";
-    OTConcatenateString (&http.parameter, "countryCode=%s&locale=%s&userId=%s",
-                         session->countryCode, session->locale, session->userId);
+    OTUrlExpand (&parameter, "countryCode=%s&locale=%s&userId=%s",
+                 session->countryCode, session->locale, session->userId);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter)
         {
             isException = 1;
@@ -59,7 +63,7 @@ OTServiceGetFeedActivities (struct OTSessionContainer *session, void *threadHand
         }
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.parameter);
+    OTUrlFree (&parameter);
     return content;
 }
 
@@ -68,11 +72,14 @@ OTServiceGetFeedActivityUnseenExists (struct OTSessionContainer *session, void *
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer parameter;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = GET;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
 
     if (session->restrictedMode)
         {
@@ -82,8 +89,9 @@ OTServiceGetFeedActivityUnseenExists (struct OTSessionContainer *session, void *
 
     http.type = &reqType;
     http.endpoint = "/v2/feed/activities/unseen/exists";
-    OTConcatenateString (&http.parameter, "countryCode=%s&locale=%s&userId=%s",
-                         session->countryCode, session->locale, session->userId);
+    OTUrlExpand (&parameter, "countryCode=%s&locale=%s&userId=%s",
+                 session->countryCode, session->locale, session->userId);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter)
         {
             isException = 1;
@@ -92,7 +100,7 @@ OTServiceGetFeedActivityUnseenExists (struct OTSessionContainer *session, void *
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.parameter);
+    OTUrlFree (&parameter);
     return content;
 }
 
@@ -101,11 +109,14 @@ OTServiceFeedActivitySeen (struct OTSessionContainer *session, void *threadHandl
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer parameter;
     enum OTHttpTypes reqType = PUT;
     enum OTStatus status = UNKNOWN;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
 
     if (session->restrictedMode)
         return status;
@@ -113,8 +124,8 @@ OTServiceFeedActivitySeen (struct OTSessionContainer *session, void *threadHandl
     http.type = &reqType;
     http.isDummy = 1;
     http.endpoint = "/v2/feed/activities/seen";
-    OTConcatenateString (&http.parameter, "userId=%s&countryCode=%s", session->userId,
-                         session->countryCode);
+    OTUrlExpand (&parameter, "userId=%s&countryCode=%s", session->userId, session->countryCode);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter)
         {
             isException = 1;
@@ -123,6 +134,6 @@ OTServiceFeedActivitySeen (struct OTSessionContainer *session, void *threadHandl
 
     status = OTServiceRequestSilent (session, &http, threadHandle);
 end:
-    free (http.parameter);
+    OTUrlFree (&parameter);
     return status;
 }
@@ -23,6 +23,7 @@
 /* openTIDAL playlist manipulation service
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,34 +33,204 @@
 #include "../openTIDAL.h"
 #include "OTService.h"
 
+/* Playlists with a remembered entity-tag. The least recently used one is replaced. */
+#define OTSERVICE_PLAYLIST_TAGS 16
+
+struct OTServicePlaylistTag
+{
+    char *id;
+    char *entityTag;
+    unsigned long used;
+};
+
+/* Entity-tags of the playlists mutated with a session. The tag of a mutation response is
+ * the precondition of the next mutation, consecutive edits skip the HEAD request. */
+struct OTServicePlaylistTags
+{
+    pthread_mutex_t mutex;
+    struct OTServicePlaylistTag entries[OTSERVICE_PLAYLIST_TAGS];
+    unsigned long clock;
+};
+
+void *
+OTServicePlaylistTagsCreate (void)
+{
+    struct OTServicePlaylistTags *ptr = NULL;
+    ptr = calloc (1, sizeof (struct OTServicePlaylistTags));
+    if (!ptr) return NULL;
+    pthread_mutex_init (&ptr->mutex, NULL);
+    return ptr;
+}
+
+void
+OTServicePlaylistTagsCleanup (void *tags)
+{
+    struct OTServicePlaylistTags *ptr = (struct OTServicePlaylistTags *)tags;
+    int i;
+    if (ptr)
+        {
+            for (i = 0; i < OTSERVICE_PLAYLIST_TAGS; i++)
+                {
+                    free (ptr->entries[i].id);
+                    free (ptr->entries[i].entityTag);
+                }
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+        }
+}
+
+/* Returns a copy of the remembered entity-tag of a playlist or NULL. Free it after use! */
+static char *
+OTServicePlaylistTagLookup (const struct OTSessionContainer *const session,
+                            const char *const id)
+{
+    struct OTServicePlaylistTags *ptr = (struct OTServicePlaylistTags *)session->playlistTags;
+    char *entityTag = NULL;
+    int i;
+    if (!ptr) return NULL;
+    pthread_mutex_lock (&ptr->mutex);
+    for (i = 0; i < OTSERVICE_PLAYLIST_TAGS; i++)
+        if (ptr->entries[i].id && strcmp (ptr->entries[i].id, id) == 0)
+            {
+                ptr->entries[i].used = ++ptr->clock;
+                entityTag = strdup (ptr->entries[i].entityTag);
+                break;
+            }
+    pthread_mutex_unlock (&ptr->mutex);
+    return entityTag;
+}
+
+/* Remember the entity-tag of a playlist. NULL forgets it. */
+static void
+OTServicePlaylistTagStore (const struct OTSessionContainer *const session, const char *const id,
+                           const char *const entityTag)
+{
+    struct OTServicePlaylistTags *ptr = (struct OTServicePlaylistTags *)session->playlistTags;
+    struct OTServicePlaylistTag *entry = NULL;
+    struct OTServicePlaylistTag *victim = NULL;
+    char *copy = NULL;
+    int i;
+    if (!ptr) return;
+    if (entityTag && !(copy = strdup (entityTag))) return;
+    pthread_mutex_lock (&ptr->mutex);
+    for (i = 0; i < OTSERVICE_PLAYLIST_TAGS && !entry; i++)
+        {
+            struct OTServicePlaylistTag *item = &ptr->entries[i];
+            if (item->id && strcmp (item->id, id) == 0)
+                entry = item;
+            else if (!victim || (victim->id && (!item->id || item->used < victim->used)))
+                victim = item;
+        }
+    if (!entry && copy)
+        {
+            /* Take over an empty or the least recently used entry. */
+            entry = victim;
+            free (entry->id);
+            free (entry->entityTag);
+            entry->entityTag = NULL;
+            entry->id = strdup (id);
+        }
+    if (entry && copy && entry->id)
+        {
+            free (entry->entityTag);
+            entry->entityTag = copy;
+            entry->used = ++ptr->clock;
+            copy = NULL;
+        }
+    else if (entry)
+        {
+            free (entry->id);
+            free (entry->entityTag);
+            entry->id = NULL;
+            entry->entityTag = NULL;
+        }
+    pthread_mutex_unlock (&ptr->mutex);
+    free (copy);
+}
+
+/* Perform a playlist mutation with the entity-tag of the playlist as precondition. The tag
+ * remembered from the previous mutation is used, otherwise it is requested with a HEAD
+ * request. The tag of the response is remembered for the next mutation. If a remembered tag
+ * is outdated (412) the current one is requested and the mutation repeated once.
+ * Asynchronous request handles are not supported, the tag has to be known before the
+ * mutation is submitted. The handle is released and NOT_SUPPORTED returned. */
+static enum OTStatus
+OTServicePlaylistMutate (struct OTSessionContainer *session, struct OTHttpContainer *http,
+                         const char *const id, void *threadHandle)
+{
+    enum OTStatus status = PRECONDITION_FAILED;
+    char *entityTag = NULL;
+    int isRemembered = 0;
+
+    if (threadHandle && ((struct OTHttpHandle *)threadHandle)->asyncRequest)
+        {
+            OTAsyncRelease ((struct OTHttpHandle *)threadHandle);
+            return NOT_SUPPORTED;
+        }
+    entityTag = OTServicePlaylistTagLookup (session, id);
+    if (entityTag)
+        isRemembered = 1;
+    else
+        entityTag = OTServiceGetPlaylistEntityTag (session, id, threadHandle);
+
+    while (entityTag)
+        {
+            OTConcatenateString (&http->entityTagHeader, "if-none-match: %s", entityTag);
+            free (entityTag);
+            entityTag = NULL;
+            if (!http->entityTagHeader) return UNKNOWN;
+            http->headerMask = HEADER_ENTITY_TAG;
+            status = OTServiceRequestSilent (session, http, threadHandle);
+            free (http->entityTagHeader);
+            http->entityTagHeader = NULL;
+            OTServicePlaylistTagStore (session, id, status == SUCCESS ? http->entityTag : NULL);
+            free (http->entityTag);
+            http->entityTag = NULL;
+            if (status != PRECONDITION_FAILED || !isRemembered) break;
+
+            /* Another client changed the playlist. */
+            isRemembered = 0;
+            http->httpOk = -1;
+            http->responseCode = 0;
+            entityTag = OTServiceGetPlaylistEntityTag (session, id, threadHandle);
+        }
+    return status;
+}
+
 struct OTContentContainer *
 OTServiceCreatePlaylist (struct OTSessionContainer *session, char *title, char *description,
                          void *threadHandle)
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
+    struct OTUrlBuffer postData;
     struct OTContentContainer *content = NULL;
-    char *encTitle = NULL;
-    char *encDescription = NULL;
     enum OTHttpTypes reqType = POST;
 
     if (session->restrictedMode)
         return content;
 
-    /* UrlEncode strings. */
-    encTitle = OTUrlEncode (title);
-    encDescription = OTUrlEncode (description);
-    if (!encTitle || !encDescription)
-        {
-            isException = 1;
-            goto end;
-        }
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
     http.type = &reqType;
-    OTConcatenateString (&http.endpoint, "/v1/users/%s/playlists", session->userId);
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
-    OTConcatenateString (&http.postData, "title=%s&description=%s", encTitle, encDescription);
+    OTUrlExpand (&endpoint, "/v1/users/%s/playlists", session->userId);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    /* Title and description are encoded straight into the post data. */
+    OTUrlAppend (&postData, "title=");
+    OTUrlAppendEncoded (&postData, title);
+    OTUrlAppend (&postData, "&description=");
+    OTUrlAppendEncoded (&postData, description);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
+    http.postData = OTUrlString (&postData);
     if (!http.parameter || !http.endpoint || !http.postData)
         {
             isException = 1;
@@ -68,11 +239,9 @@ OTServiceCreatePlaylist (struct OTSessionContainer *session, char *title, char *
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (http.postData);
-    free (encTitle);
-    free (encDescription);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
+    OTUrlFree (&postData);
     return content;
 }
 
@@ -83,37 +252,49 @@ OTServiceGetPlaylistEntityTag (struct OTSessionContainer *session, const char *c
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     char *value = NULL;
     enum OTHttpTypes reqType = HEAD;
     enum OTStatus status = UNKNOWN;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+    /* The entity-tag is read from the response header. Asynchronous request handles
+     * do not return the response, they are released. */
+    if (threadHandle && ((struct OTHttpHandle *)threadHandle)->asyncRequest)
+        {
+            OTAsyncRelease ((struct OTHttpHandle *)threadHandle);
+            return NULL;
+        }
     http.type = &reqType;
-    OTConcatenateString (&http.endpoint, "/v1/playlists/%s", id);
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
+    OTUrlExpand (&endpoint, "/v1/playlists/%s", id);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter || !http.endpoint)
         {
             isException = 1;
             goto end;
         }
 
+    /* The header callback captures the entity-tag, the response is not buffered. */
+    http.headerMask = HEADER_ENTITY_TAG;
     status = OTServiceRequestSilent (session, &http, threadHandle);
     if (status == SUCCESS)
         {
-            char *tmp = OTHttpParseHeader (http.response, "etag");
-            if (tmp)
-                {
-                    /* Remove whitespace after value (libcurl does not like this whitespace). */
-                    if (tmp[strlen (tmp) - 1] != '"')
-                        tmp[strlen (tmp) - 1] = '\0';
-                    value = strdup (tmp);
-                }
+            value = http.entityTag;
+            http.entityTag = NULL;
         }
 end:
-    free (http.endpoint);
-    free (http.parameter);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     free (http.response);
+    free (http.entityTag);
     return value;
 }
 
@@ -123,39 +304,37 @@ OTServiceDeletePlaylistItem (struct OTSessionContainer *session, const char *con
 {
     int isException = 0;
     struct OTHttpContainer http;
-    char *entityTag;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     enum OTHttpTypes reqType = DELETE;
     enum OTStatus status = UNKNOWN;
 
     if (session->restrictedMode)
         return status;
 
-    entityTag = OTServiceGetPlaylistEntityTag (session, id, threadHandle);
-    if (!entityTag)
-        {
-            isException = 1;
-            status = PRECONDITION_FAILED;
-            goto end;
-        }
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+
     http.type = &reqType;
     http.isDummy = 1;
-    OTConcatenateString (&http.endpoint, "/v1/playlists/%s/items/%d", id, index);
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
-    OTConcatenateString (&http.entityTagHeader, "if-none-match: %s", entityTag);
-    if (!http.parameter || !http.endpoint || !http.entityTagHeader)
+    OTUrlExpand (&endpoint, "/v1/playlists/%s/items/%d", id, index);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
+    if (!http.parameter || !http.endpoint)
         {
             isException = 1;
             goto end;
         }
 
-    status = OTServiceRequestSilent (session, &http, threadHandle);
+    status = OTServicePlaylistMutate (session, &http, id, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (http.entityTagHeader);
-    free (entityTag);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     return status;
 }
 
@@ -165,41 +344,43 @@ OTServiceMovePlaylistItem (struct OTSessionContainer *session, const char *const
 {
     int isException = 0;
     struct OTHttpContainer http;
-    char *entityTag = NULL;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
+    struct OTUrlBuffer postData;
     enum OTHttpTypes reqType = POST;
     enum OTStatus status = UNKNOWN;
 
     if (session->restrictedMode)
         return status;
 
-    entityTag = OTServiceGetPlaylistEntityTag (session, id, threadHandle);
-    if (!entityTag)
-        {
-            isException = 1;
-            status = PRECONDITION_FAILED;
-            goto end;
-        }
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
+
     http.type = &reqType;
     http.isDummy = 1;
-    OTConcatenateString (&http.endpoint, "/v1/playlists/%s/items/%d", id, index);
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
-    OTConcatenateString (&http.postData, "toIndex=%d", toIndex);
-    OTConcatenateString (&http.entityTagHeader, "if-none-match: %s", entityTag);
-    if (!http.parameter || !http.endpoint || !http.postData || !http.entityTagHeader)
+    OTUrlExpand (&endpoint, "/v1/playlists/%s/items/%d", id, index);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    OTUrlExpand (&postData, "toIndex=%d", toIndex);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
+    http.postData = OTUrlString (&postData);
+    if (!http.parameter || !http.endpoint || !http.postData)
         {
             isException = 1;
             goto end;
         }
 
-    status = OTServiceRequestSilent (session, &http, threadHandle);
+    status = OTServicePlaylistMutate (session, &http, id, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (http.postData);
-    free (http.entityTagHeader);
-    free (entityTag);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
+    OTUrlFree (&postData);
     return status;
 }
 
@@ -210,42 +391,44 @@ OTServiceAddPlaylistItem (struct OTSessionContainer *session, const char *const
 {
     int isException = 0;
     struct OTHttpContainer http;
-    char *entityTag = NULL;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
+    struct OTUrlBuffer postData;
     enum OTHttpTypes reqType = POST;
     enum OTStatus status = UNKNOWN;
 
     if (session->restrictedMode)
         return status;
 
-    entityTag = OTServiceGetPlaylistEntityTag (session, id, threadHandle);
-    if (!entityTag)
-        {
-            isException = 1;
-            status = PRECONDITION_FAILED;
-            goto end;
-        }
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
+
     http.type = &reqType;
     http.isDummy = 1;
-    OTConcatenateString (&http.endpoint, "/v1/playlists/%s/items", id);
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
-    OTConcatenateString (&http.postData, "itemIds=%s&onArtifactNotFound=%s&onDupes=%s", itemId,
-                         onArtifactNotFound, onDupes);
-    OTConcatenateString (&http.entityTagHeader, "if-none-match: %s", entityTag);
-    if (!http.parameter || !http.endpoint || !http.postData || !http.entityTagHeader)
+    OTUrlExpand (&endpoint, "/v1/playlists/%s/items", id);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    OTUrlExpand (&postData, "itemIds=%s&onArtifactNotFound=%s&onDupes=%s", itemId,
+                 onArtifactNotFound, onDupes);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
+    http.postData = OTUrlString (&postData);
+    if (!http.parameter || !http.endpoint || !http.postData)
         {
             isException = 1;
             goto end;
         }
 
-    status = OTServiceRequestSilent (session, &http, threadHandle);
+    status = OTServicePlaylistMutate (session, &http, id, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (http.postData);
-    free (http.entityTagHeader);
-    free (entityTag);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
+    OTUrlFree (&postData);
     return status;
 }
 
@@ -256,51 +439,50 @@ OTServiceAddPlaylistItems (struct OTSessionContainer *session, const char *const
 {
     int isException = 0;
     struct OTHttpContainer http;
-    char *entityTag = NULL;
-    char *arrayString = NULL;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    char postDataStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
+    struct OTUrlBuffer postData;
+    int i;
     enum OTHttpTypes reqType = POST;
     enum OTStatus status = UNKNOWN;
 
     if (session->restrictedMode)
         return status;
 
-    entityTag = OTServiceGetPlaylistEntityTag (session, id, threadHandle);
-    if (!entityTag)
-        {
-            isException = 1;
-            status = PRECONDITION_FAILED;
-            goto end;
-        }
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
+    OTUrlInit (&postData, postDataStorage, sizeof (postDataStorage));
+
     http.type = &reqType;
     http.isDummy = 1;
-
-    OTArrayToString (&arrayString, itemIds, size);
-    if (!arrayString)
+    OTUrlExpand (&endpoint, "/v1/playlists/%s/items", id);
+    OTUrlExpand (&parameter, "countryCode=%s", session->countryCode);
+    OTUrlAppend (&postData, "itemIds=");
+    for (i = 0; i < size; i++)
         {
-            isException = 1;
-            goto end;
+            if (i)
+                OTUrlAppend (&postData, ", ");
+            OTUrlAppend (&postData, itemIds[i]);
         }
-
-    OTConcatenateString (&http.endpoint, "/v1/playlists/%s/items", id);
-    OTConcatenateString (&http.parameter, "countryCode=%s", session->countryCode);
-    OTConcatenateString (&http.postData, "itemIds=%s&onArtifactNotFound=%s&onDupes=%s", arrayString,
-                         onArtifactNotFound, onDupes);
-    OTConcatenateString (&http.entityTagHeader, "if-none-match: %s", entityTag);
-    if (!http.parameter || !http.endpoint || !http.postData || !http.entityTagHeader)
+    OTUrlExpand (&postData, "&onArtifactNotFound=%s&onDupes=%s", onArtifactNotFound, onDupes);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
+    http.postData = OTUrlString (&postData);
+    if (!http.parameter || !http.endpoint || !http.postData)
         {
             isException = 1;
             goto end;
         }
 
-    status = OTServiceRequestSilent (session, &http, threadHandle);
+    status = OTServicePlaylistMutate (session, &http, id, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (http.postData);
-    free (http.entityTagHeader);
-    free (entityTag);
-    free (arrayString);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
+    OTUrlFree (&postData);
     return status;
 }
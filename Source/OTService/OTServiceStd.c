@@ -39,18 +39,28 @@ OTServiceGetStandard (struct OTSessionContainer *session, const char *const pref
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = GET;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
     http.type = &reqType;
     if (suffix)
-        OTConcatenateString (&http.endpoint, "/v1/%s/%s/%s", prefix, id, suffix);
+        OTUrlExpand (&endpoint, "/v1/%s/%s/%s", prefix, id, suffix);
     else
-        OTConcatenateString (&http.endpoint, "/v1/%s/%s", prefix, id);
-    OTConcatenateString (&http.parameter, "countryCode=%s&limit=%d&offset=%d", session->countryCode,
-                         limit, offset);
+        OTUrlExpand (&endpoint, "/v1/%s/%s", prefix, id);
+    OTUrlExpand (&parameter, "countryCode=%s&limit=%d&offset=%d", session->countryCode,
+                 limit, offset);
+    http.isCacheable = 1;
+    http.isArtefact = 1;
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter || !http.endpoint)
         {
             isException = 1;
@@ -59,8 +69,8 @@ OTServiceGetStandard (struct OTSessionContainer *session, const char *const pref
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     return content;
 }
 
@@ -70,27 +80,40 @@ OTServiceGetPage (struct OTSessionContainer *session, const char *const suffix,
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = GET;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
     http.type = &reqType;
-    OTConcatenateString (&http.endpoint, "/v1/pages/%s", suffix);
-    /* Check for suffix. */
+    OTUrlExpand (&endpoint, "/v1/pages/%s", suffix);
+    /* Check for suffix. Pages of an artefact are the same for every user. Other pages are
+     * personalised and cached per user. */
+    http.isCacheable = 1;
     if (strcmp (suffix, "album") == 0)
-        OTConcatenateString (&http.parameter, "countryCode=%s&locale=%s&deviceType=%s&albumId=%s",
-                             session->countryCode, session->locale, session->deviceType, id);
+        OTUrlExpand (&parameter, "countryCode=%s&locale=%s&deviceType=%s&albumId=%s",
+                     session->countryCode, session->locale, session->deviceType, id);
     else if (strcmp (suffix, "artist") == 0)
-        OTConcatenateString (&http.parameter, "countryCode=%s&locale=%s&deviceType=%s&artistId=%s",
-                             session->countryCode, session->locale, session->deviceType, id);
+        OTUrlExpand (&parameter, "countryCode=%s&locale=%s&deviceType=%s&artistId=%s",
+                     session->countryCode, session->locale, session->deviceType, id);
     else if (strcmp (suffix, "mix") == 0)
-        OTConcatenateString (&http.parameter, "countryCode=%s&locale=%s&deviceType=%s&mixId=%s",
-                             session->countryCode, session->locale, session->deviceType, id);
+        OTUrlExpand (&parameter, "countryCode=%s&locale=%s&deviceType=%s&mixId=%s",
+                     session->countryCode, session->locale, session->deviceType, id);
     else
-        OTConcatenateString (
-            &http.parameter, "countryCode=%s&locale=%s&deviceType=%s&limit=%d&offset=%d",
-            session->countryCode, session->locale, session->deviceType, limit, offset);
+        {
+            OTUrlExpand (&parameter, "countryCode=%s&locale=%s&deviceType=%s&limit=%d&offset=%d",
+                         session->countryCode, session->locale, session->deviceType, limit,
+                         offset);
+            http.isPrivate = 1;
+        }
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter || !http.endpoint)
         {
             isException = 1;
@@ -99,8 +122,8 @@ OTServiceGetPage (struct OTSessionContainer *session, const char *const suffix,
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     return content;
 }
 
@@ -110,29 +133,30 @@ OTServiceSearch (struct OTSessionContainer *session, const char *const suffix, c
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     struct OTContentContainer *content = NULL;
     enum OTHttpTypes reqType = GET;
-    char *enc = NULL;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
     http.type = &reqType;
 
-    /* UrlEncode string. */
-    enc = OTUrlEncode (query);
-    if (!enc)
-        {
-            isException = 1;
-            goto end;
-        }
-
     /* If NULL: Search all. */
     if (suffix)
-        OTConcatenateString (&http.endpoint, "/v1/search/%s", suffix);
+        OTUrlExpand (&endpoint, "/v1/search/%s", suffix);
     else
-        OTConcatenateString (&http.endpoint, "/v1/search");
-    OTConcatenateString (&http.parameter, "countryCode=%s&limit=%d&offset=%d&query=%s",
-                         session->countryCode, limit, offset, enc);
+        OTUrlExpand (&endpoint, "/v1/search");
+    /* The query is encoded straight into the parameter buffer. */
+    OTUrlExpand (&parameter, "countryCode=%s&limit=%d&offset=%d&query=", session->countryCode,
+                 limit, offset);
+    OTUrlAppendEncoded (&parameter, query);
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter || !http.endpoint)
         {
             isException = 1;
@@ -141,9 +165,8 @@ OTServiceSearch (struct OTSessionContainer *session, const char *const suffix, c
 
     content = OTServiceRequestStandard (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
-    free (enc);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     return content;
 }
 
@@ -153,29 +176,36 @@ OTServiceGetStream (struct OTSessionContainer *session, const char *const prefix
 {
     int isException = 0;
     struct OTHttpContainer http;
+    char endpointStorage[OTURL_STORAGE];
+    char parameterStorage[OTURL_STORAGE];
+    struct OTUrlBuffer endpoint;
+    struct OTUrlBuffer parameter;
     struct OTContentStreamContainer *content = NULL;
     enum OTHttpTypes reqType = GET;
 
     /* Initialise values in structure. */
     OTHttpContainerInit (&http);
+    OTUrlInit (&endpoint, endpointStorage, sizeof (endpointStorage));
+    OTUrlInit (&parameter, parameterStorage, sizeof (parameterStorage));
     http.type = &reqType;
 
     /* Check for preview-mode. */
     if (!isPreview)
-        OTConcatenateString (&http.endpoint, "/v1/%s/%s/playbackinfopostpaywall", prefix, id);
+        OTUrlExpand (&endpoint, "/v1/%s/%s/playbackinfopostpaywall", prefix, id);
     else
-        OTConcatenateString (&http.endpoint, "/v1/%s/%s/playbackinfoprepaywall", prefix, id);
+        OTUrlExpand (&endpoint, "/v1/%s/%s/playbackinfoprepaywall", prefix, id);
 
     if (strcmp (prefix, "videos") == 0)
-        OTConcatenateString (
-            &http.parameter,
-            "countryCode=%s&videoquality=%s&playbackmode=STREAM&assetpresentation=FULL",
-            session->countryCode, session->videoQuality);
+        OTUrlExpand (&parameter,
+                     "countryCode=%s&videoquality=%s&playbackmode=STREAM&assetpresentation=FULL",
+                     session->countryCode, session->videoQuality);
     else
-        OTConcatenateString (
-            &http.parameter,
-            "countryCode=%s&audioquality=%s&playbackmode=STREAM&assetpresentation=FULL",
-            session->countryCode, session->audioQuality);
+        OTUrlExpand (&parameter,
+                     "countryCode=%s&audioquality=%s&playbackmode=STREAM&assetpresentation=FULL",
+                     session->countryCode, session->audioQuality);
+    http.isArtefact = 1;
+    http.endpoint = OTUrlString (&endpoint);
+    http.parameter = OTUrlString (&parameter);
     if (!http.parameter || !http.endpoint)
         {
             isException = 1;
@@ -184,8 +214,8 @@ OTServiceGetStream (struct OTSessionContainer *session, const char *const prefix
 
     content = OTServiceRequestStream (session, &http, threadHandle);
 end:
-    free (http.endpoint);
-    free (http.parameter);
+    OTUrlFree (&endpoint);
+    OTUrlFree (&parameter);
     return content;
 }
 
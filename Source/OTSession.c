@@ -24,8 +24,10 @@
  */
 
 #include "OTHelper.h"
+#include "OTHttp.h"
 #include "OTJson.h"
 #include "OTPersistent.h"
+#include "OTService/OTService.h"
 #include <curl/curl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -47,7 +49,15 @@ OTSessionInit (void)
     OTSessionContainerInit (ptr);
     /* One time libcurl global init. */
     curl_global_init (CURL_GLOBAL_ALL);
-    ptr->mainHttpHandle = curl_easy_init ();
+    ptr->httpShare = OTHttpShareCreate ();
+    ptr->httpTickets = OTHttpTicketsCreate ();
+    ptr->httpHeaders = OTHttpTokensCreate ();
+    ptr->httpMetrics = OTHttpMetricsCreate ();
+    ptr->httpBreaker = OTHttpBreakerCreate ();
+    ptr->httpLimiter = OTHttpLimiterCreate ();
+    ptr->httpFlights = OTHttpFlightsCreate ();
+    ptr->playlistTags = OTServicePlaylistTagsCreate ();
+    ptr->mainHttpHandle = OTHttpThreadHandleCreate ();
     return ptr;
 }
 
@@ -75,7 +85,23 @@ OTSessionContainerInit (struct OTSessionContainer *const session)
     session->renewalTree = NULL;
     session->restrictedMode = 1;
     session->verboseMode = 0;
+    session->multiplexStreams = 0;
     session->mainHttpHandle = NULL;
+    session->httpShare = NULL;
+    session->httpTickets = NULL;
+    session->httpHeaders = NULL;
+    session->refresher = NULL;
+    session->httpMetrics = NULL;
+    session->httpBreaker = NULL;
+    session->httpLimiter = NULL;
+    session->httpFlights = NULL;
+    session->playlistTags = NULL;
+    session->cache = NULL;
+    session->diskCache = NULL;
+    session->negativeCache = NULL;
+    session->retryLimit = 3;
+    session->retryDeadline = 15000;
+    session->offlineFallback = 0;
 }
 
 /* Allocate the OAuth2 clientId and clientSecret into heap */
@@ -101,6 +127,8 @@ OTSessionLogin (struct OTSessionContainer *const session, const char *const loca
 
             session->persistentFileLocation = strdup (location);
             if (!session->persistentFileLocation) return -1;
+            /* Resume the TLS sessions of the previous process. */
+            OTHttpTicketsLoad (session);
             stream = OTPersistentLoad (session);
             if (!stream) return -1;
             status = OTPersistentParse (session, stream);
@@ -116,6 +144,33 @@ OTSessionVerbose (struct OTSessionContainer *const session, const int enabled)
     session->verboseMode = enabled;
 }
 
+/* Change the retry policy. A retryLimit of 0 disables retries. */
+void
+OTSessionRetry (struct OTSessionContainer *const session, const int retryLimit,
+                const long deadline)
+{
+    session->retryLimit = retryLimit > 0 ? retryLimit : 0;
+    session->retryDeadline = deadline > 0 ? deadline : 0;
+}
+
+/* Enable or disable the offline fallback. If a request fails in the transport or is
+ * rejected by the circuit breaker, an expired cached response is returned instead. */
+void
+OTSessionOffline (struct OTSessionContainer *const session, const int enabled)
+{
+    session->offlineFallback = enabled ? 1 : 0;
+}
+
+/* Enable or disable HTTP/2 multiplexing. Applied to every handle with the next request. */
+void
+OTSessionMultiplex (struct OTSessionContainer *const session, const int maxStreams)
+{
+    if (maxStreams > 0)
+        session->multiplexStreams = maxStreams;
+    else
+        session->multiplexStreams = 0;
+}
+
 /* Change audioQuality and videoQuality pointer. */
 void
 OTSessionChangeQuality (struct OTSessionContainer *const session, enum OTQuality quality)
@@ -155,6 +210,7 @@ OTSessionWriteChanges (const struct OTSessionContainer *session)
     if (session->persistentFileLocation)
         {
             int status = OTPersistentCreate (session, session->persistentFileLocation);
+            OTHttpTicketsSave (session);
             return status;
         }
     else
@@ -167,9 +223,23 @@ OTSessionCleanup (struct OTSessionContainer *session)
     if (session)
         {
             if (session->verboseMode) fprintf (stderr, "* Free OTSessionContainer\n");
+            /* Stop the token refresher and wait for the cache refreshes and the warm-up
+             * first, they read the credentials and use the other objects. */
+            OTSessionBackgroundRefresh (session, 0);
+            OTHttpFlightsCleanup (session->httpFlights);
             free (session->clientId);
             free (session->clientSecret);
-            curl_easy_cleanup (session->mainHttpHandle);
+            OTHttpThreadHandleCleanup (session->mainHttpHandle);
+            if (OTHttpShareCleanup (session->httpShare) != 0 && session->verboseMode)
+                fprintf (stderr, "* Share object is still in use. Cleanup the http-handles "
+                                 "before the session.\n");
+            OTHttpTicketsSave (session);
+            OTHttpTicketsCleanup (session->httpTickets);
+            OTHttpTokensCleanup (session->httpHeaders);
+            OTHttpMetricsCleanup (session->httpMetrics);
+            OTHttpBreakerCleanup (session->httpBreaker);
+            OTHttpLimiterCleanup (session->httpLimiter);
+            OTServicePlaylistTagsCleanup (session->playlistTags);
             curl_global_cleanup ();
             enum OTTypes type = SESSION_CONTAINER;
             OTDeallocContainer (session, type);
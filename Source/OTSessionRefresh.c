@@ -22,84 +22,316 @@
 
 /* openTIDAL session refresh service
  */
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+#include "OTHttp.h"
 #include "OTJson.h"
 #include "openTIDAL.h"
 
-enum OTStatus
-OTSessionRefresh (struct OTSessionContainer *session)
+/* The background refresher renews the token this many seconds before it expires, one minute
+ * before a request would notice it. Failed renewals are repeated after the retry interval. */
+#define OTSESSION_REFRESH_LEAD 360
+#define OTSESSION_REFRESH_RETRY 30
+
+/* Serialises the start, the stop and the wake-ups of refreshers. The asynchronous engines
+ * of all threads may start the one of their session, every request may wake it. */
+static pthread_mutex_t OTSessionRefresherLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct OTSessionRefresher
+{
+    struct OTSessionContainer *session;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int isStopping;
+    /* Set by requests that saw an expiring token. */
+    int isWoken;
+};
+
+/* Renew the accessToken with the refreshToken and publish it. The caller has claimed the
+ * refresh. */
+static enum OTStatus
+OTSessionRenewClaimed (struct OTSessionContainer *session)
 {
     enum OTStatus status = SUCCESS;
     time_t currentTimeStamp = time (NULL);
-    double diffTimeStamp;
-    struct OTContentContainer *req;
+    struct OTContentContainer *req = NULL;
+    void *handle = NULL;
 
-    if (session->verboseMode)
-        fprintf (stderr, "* Compare OAuth2 accessToken timestamp with SystemRTC timestamp...\n");
+    /* The refresh has its own handle, the caller may be using any of the others. */
+    if (session->verboseMode) fprintf (stderr, "* Performing OTServiceRefreshBearerToken...\n");
+    handle = OTHttpThreadHandleCreate ();
+    if (handle) req = OTServiceRefreshBearerToken (session, session->refreshToken, handle);
+    OTHttpThreadHandleCleanup (handle);
+    if (req)
+        {
+            if (req->status == SUCCESS)
+                {
+                    if (session->verboseMode) fprintf (stderr, "* Parse JSON...\n");
+
+                    char *accessTokenString = NULL;
+                    time_t timeFrameNumber = 0;
 
-    if (session->restrictedMode) goto end;
+                    accessTokenString = OTJsonGetObjectItemStringValue (req->tree, "access_token");
+                    timeFrameNumber = OTJsonGetObjectItemNumberValue (req->tree, "expires_in");
 
-    /* Check if OAuth2 Bearer timestamp is in the future. */
-    if (currentTimeStamp > session->expiresIn)
-        diffTimeStamp = difftime (currentTimeStamp, session->expiresIn);
+                    if (accessTokenString && timeFrameNumber != 0)
+                        {
+                            status = SUCCESS;
+                            OTHttpTokenPublish (session, req->tree, accessTokenString,
+                                                currentTimeStamp + timeFrameNumber);
+                            free (req);
+                            /* Update config. */
+                            if (session->verboseMode) fprintf (stderr, "* Write to config...\n");
+                            OTPersistentCreate (session, session->persistentFileLocation);
+                        }
+                    else
+                        {
+                            status = MALLOC_ERROR;
+                            OTDeallocContainer (req, CONTENT_CONTAINER);
+                        }
+                }
+            else
+                {
+                    enum OTTypes type = CONTENT_CONTAINER;
+                    status = req->status;
+                    OTDeallocContainer (req, type);
+                }
+        }
     else
-        diffTimeStamp = difftime (session->expiresIn, currentTimeStamp);
+        status = MALLOC_ERROR;
+    return status;
+}
 
-    /* If OAuth Bearer timestamp is not in the future with a difference of more than five minutes.
-     */
-    if (!(currentTimeStamp < session->expiresIn && (time_t)diffTimeStamp >= 300))
+/* Claim the refresh and renew the accessToken. Returns SUCCESS without a request if another
+ * thread is already refreshing. */
+static enum OTStatus
+OTSessionRenew (struct OTSessionContainer *session)
+{
+    enum OTStatus status;
+    if (OTHttpTokenRefreshBegin (session) != 0)
         {
             if (session->verboseMode)
-                fprintf (stderr, "* Performing OTServiceRefreshBearerToken...\n");
-            req = OTServiceRefreshBearerToken (session, session->refreshToken, NULL);
-            if (req)
-                {
-                    if (req->status == SUCCESS)
-                        {
-                            if (session->verboseMode) fprintf (stderr, "* Parse JSON...\n");
-
-                            struct OTJsonContainer *accessToken = NULL;
-                            struct OTJsonContainer *timeFrame = NULL;
-                            char *accessTokenString = NULL;
-                            time_t timeFrameNumber = 0;
+                fprintf (stderr, "* Refresh is performed by another thread\n");
+            return SUCCESS;
+        }
+    status = OTSessionRenewClaimed (session);
+    OTHttpTokenRefreshEnd (session);
+    return status;
+}
 
-                            /* Cleanup previous request. */
-                            OTJsonDelete (session->renewalTree);
-                            session->renewalTree = req->tree;
-                            free (req);
+/* Renew a token the server rejected with 401. Requests of all threads rejected with the
+ * same token share one renewal: if another thread is refreshing, wait for its result, if
+ * the token was already replaced, use the new one. Returns SUCCESS if a different token is
+ * published, otherwise UNAUTHORISED or the status of the failed renewal. */
+enum OTStatus
+OTSessionRenewRejected (struct OTSessionContainer *session,
+                        const struct OTHttpToken *const rejected)
+{
+    struct OTHttpToken *token = NULL;
+    enum OTStatus status = UNAUTHORISED;
+    int isClaimed = 0;
+    int isWaited = 0;
 
-                            accessToken
-                                = OTJsonGetObjectItem (session->renewalTree, "access_token");
-                            accessTokenString = OTJsonGetStringValue (accessToken);
-                            timeFrame = OTJsonGetObjectItem (session->renewalTree, "expires_in");
-                            timeFrameNumber = OTJsonGetNumberValue (timeFrame);
-
-                            if (accessToken && timeFrameNumber != 0)
-                                {
-                                    status = SUCCESS;
-                                    session->accessToken = accessTokenString;
-                                    session->expiresIn = currentTimeStamp + timeFrameNumber;
-                                    /* Update config. */
-                                    if (session->verboseMode)
-                                        fprintf (stderr, "* Write to config...\n");
-                                    OTPersistentCreate (session, session->persistentFileLocation);
-                                }
-                            else
-                                status = MALLOC_ERROR;
-                        }
+    if (session->restrictedMode || !session->refreshToken) return status;
+    for (;;)
+        {
+            /* The pointer is only compared, the rejected snapshot is still referenced. */
+            token = OTHttpTokenAcquire (session);
+            OTHttpTokenRelease (token);
+            if (!token)
+                status = MALLOC_ERROR;
+            else if (token != rejected)
+                status = SUCCESS;
+            else if (isClaimed)
+                {
+                    if (session->verboseMode) fprintf (stderr, "* Renew rejected accessToken\n");
+                    status = OTSessionRenewClaimed (session);
+                }
+            else if (!isWaited)
+                {
+                    if (OTHttpTokenRefreshBegin (session) == 0)
+                        isClaimed = 1;
                     else
                         {
-                            enum OTTypes type = CONTENT_CONTAINER;
-                            status = req->status;
-                            OTDeallocContainer (req, type);
+                            OTHttpTokenRefreshWait (session);
+                            isWaited = 1;
                         }
+                    continue;
+                }
+            /* Otherwise the renewal of another thread did not replace the token. */
+            break;
+        }
+    if (isClaimed) OTHttpTokenRefreshEnd (session);
+    return status;
+}
+
+/* Refresh the accessToken if it expires within five minutes. Safe to call from every
+ * thread: only one caller performs the refresh, the others return immediately and keep
+ * using the current token until the refreshed one is published. */
+enum OTStatus
+OTSessionRefresh (struct OTSessionContainer *session)
+{
+    struct OTHttpToken *token = NULL;
+    int isExpiring;
+
+    if (session->verboseMode)
+        fprintf (stderr, "* Compare OAuth2 accessToken timestamp with SystemRTC timestamp...\n");
+
+    if (session->restrictedMode || !session->refreshToken) return SUCCESS;
+
+    token = OTHttpTokenAcquire (session);
+    if (!token) return MALLOC_ERROR;
+    isExpiring = OTHttpTokenIsExpiring (token);
+    OTHttpTokenRelease (token);
+    if (!isExpiring) return SUCCESS;
+    return OTSessionRenew (session);
+}
+
+/* Sleep until shortly before the token expires, renew it and start over. Renewals are at
+ * least the retry interval apart, so a short-lived token or a failing auth host does not
+ * turn the thread into a busy loop. Without a token to renew the thread sleeps until it
+ * is woken. */
+static void *
+OTSessionRefresherRun (void *userp)
+{
+    struct OTSessionRefresher *ptr = (struct OTSessionRefresher *)userp;
+    struct OTSessionContainer *session = ptr->session;
+    struct OTHttpToken *token = NULL;
+    struct timespec wake;
+    time_t renewAt;
+    time_t earliest = 0;
+
+    pthread_mutex_lock (&ptr->mutex);
+    while (!ptr->isStopping)
+        {
+            renewAt = 0;
+            if (!session->restrictedMode && session->refreshToken)
+                {
+                    token = OTHttpTokenAcquire (session);
+                    if (token) renewAt = token->expiresIn - OTSESSION_REFRESH_LEAD;
+                    OTHttpTokenRelease (token);
+                }
+            /* A request saw the token expiring before the refresher did. */
+            if (ptr->isWoken && renewAt) renewAt = time (NULL);
+            ptr->isWoken = 0;
+            if (renewAt && renewAt < earliest) renewAt = earliest;
+
+            if (renewAt && time (NULL) >= renewAt)
+                {
+                    pthread_mutex_unlock (&ptr->mutex);
+                    if (session->verboseMode) fprintf (stderr, "* Background token refresh\n");
+                    OTSessionRenew (session);
+                    earliest = time (NULL) + OTSESSION_REFRESH_RETRY;
+                    pthread_mutex_lock (&ptr->mutex);
+                    continue;
+                }
+            if (renewAt)
+                {
+                    wake.tv_sec = renewAt;
+                    wake.tv_nsec = 0;
+                    pthread_cond_timedwait (&ptr->cond, &ptr->mutex, &wake);
                 }
             else
-                status = MALLOC_ERROR;
+                pthread_cond_wait (&ptr->cond, &ptr->mutex);
         }
-end:
+    pthread_mutex_unlock (&ptr->mutex);
+    return NULL;
+}
+
+/* Start the refresher of the session. Must be called with OTSessionRefresherLock held.
+ * Returns the refresher or NULL if the thread can not be started. */
+static struct OTSessionRefresher *
+OTSessionRefresherStart (struct OTSessionContainer *const session)
+{
+    struct OTSessionRefresher *ptr = NULL;
+    ptr = malloc (sizeof (struct OTSessionRefresher));
+    if (!ptr) return NULL;
+    ptr->session = session;
+    ptr->isStopping = 0;
+    ptr->isWoken = 0;
+    pthread_mutex_init (&ptr->mutex, NULL);
+    pthread_cond_init (&ptr->cond, NULL);
+    if (pthread_create (&ptr->thread, NULL, OTSessionRefresherRun, ptr) != 0)
+        {
+            pthread_cond_destroy (&ptr->cond);
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+            return NULL;
+        }
+    session->refresher = ptr;
+    return ptr;
+}
+
+/* Wake a refresher. Must be called with OTSessionRefresherLock held, so it can not be
+ * stopped and freed meanwhile. */
+static void
+OTSessionRefresherSignal (struct OTSessionRefresher *const ptr)
+{
+    pthread_mutex_lock (&ptr->mutex);
+    ptr->isWoken = 1;
+    pthread_cond_signal (&ptr->cond);
+    pthread_mutex_unlock (&ptr->mutex);
+}
+
+/* Start or stop the background refresher of the session. Returns 0 on success and -1 if
+ * the thread can not be started. */
+int
+OTSessionBackgroundRefresh (struct OTSessionContainer *const session, const int enabled)
+{
+    struct OTSessionRefresher *ptr = NULL;
+    int status = 0;
+    pthread_mutex_lock (&OTSessionRefresherLock);
+    ptr = (struct OTSessionRefresher *)session->refresher;
+    if (enabled && !ptr)
+        {
+            if (!OTSessionRefresherStart (session)) status = -1;
+        }
+    else if (!enabled && ptr)
+        {
+            /* Detached first, the lock keeps wake-ups away until it is freed. */
+            session->refresher = NULL;
+            pthread_mutex_lock (&ptr->mutex);
+            ptr->isStopping = 1;
+            pthread_cond_signal (&ptr->cond);
+            pthread_mutex_unlock (&ptr->mutex);
+            pthread_join (ptr->thread, NULL);
+            pthread_cond_destroy (&ptr->cond);
+            pthread_mutex_destroy (&ptr->mutex);
+            free (ptr);
+        }
+    pthread_mutex_unlock (&OTSessionRefresherLock);
     return status;
 }
+
+/* Hand an expiring token over to the background refresher. Returns 0 if the refresher is
+ * running, -1 if the caller has to refresh the token itself. */
+int
+OTSessionRefresherWake (const struct OTSessionContainer *const session)
+{
+    struct OTSessionRefresher *ptr = NULL;
+    pthread_mutex_lock (&OTSessionRefresherLock);
+    ptr = (struct OTSessionRefresher *)session->refresher;
+    if (ptr) OTSessionRefresherSignal (ptr);
+    pthread_mutex_unlock (&OTSessionRefresherLock);
+    return ptr ? 0 : -1;
+}
+
+/* Renew the token without blocking the caller: the refresher is woken and, if it is not
+ * running, started. A rejected token is renewed as well. Used by the asynchronous request
+ * engine, whose thread drives the transfers of all its requests. Returns 0 on success and
+ * -1 if the refresher can not be started. */
+int
+OTSessionRenewInBackground (struct OTSessionContainer *const session)
+{
+    struct OTSessionRefresher *ptr = NULL;
+    pthread_mutex_lock (&OTSessionRefresherLock);
+    ptr = (struct OTSessionRefresher *)session->refresher;
+    if (!ptr) ptr = OTSessionRefresherStart (session);
+    if (ptr) OTSessionRefresherSignal (ptr);
+    pthread_mutex_unlock (&OTSessionRefresherLock);
+    return ptr ? 0 : -1;
+}
@@ -20,42 +20,208 @@
     THE SOFTWARE.
 */
 
-/* RFC 3986 url-encoding.
+/* RFC 3986 url-encoding and the url builder.
  */
 
-#include <ctype.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "OTHelper.h"
 
-/* Converts an integer value to its hex character. */
-static char
-to_hex (char code)
+/* Characters which are not percent-encoded: 0-9, A-Z, a-z, '-', '.', '_' and '~'. */
+static const char OTUrlUnreserved[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const char OTUrlHex[] = "0123456789abcdef";
+
+/* Use the storage of the caller until the string outgrows it. The storage may be NULL. */
+void
+OTUrlInit (struct OTUrlBuffer *const buffer, char *storage, const size_t capacity)
 {
-    static char hex[] = "0123456789abcdef";
-    return hex[code & 15];
+    buffer->data = storage;
+    buffer->storage = storage;
+    buffer->storageCapacity = storage ? capacity : 0;
+    buffer->size = 0;
+    buffer->capacity = storage ? capacity : 0;
+    buffer->isFailed = 0;
+    if (storage && capacity) storage[0] = '\0';
 }
 
-/* Returns a url-encoded version of str */
-char *
-OTUrlEncode (char *str)
+/* Empty the string and keep the memory. */
+void
+OTUrlReset (struct OTUrlBuffer *const buffer)
+{
+    buffer->size = 0;
+    buffer->isFailed = 0;
+    if (buffer->data) buffer->data[0] = '\0';
+}
+
+void
+OTUrlFree (struct OTUrlBuffer *const buffer)
+{
+    if (buffer->data != buffer->storage) free (buffer->data);
+    OTUrlInit (buffer, buffer->storage, buffer->storageCapacity);
+}
+
+/* Make room for length more characters and the terminator. */
+static int
+OTUrlReserve (struct OTUrlBuffer *const buffer, const size_t length)
+{
+    size_t capacity;
+    char *data = NULL;
+    if (buffer->isFailed) return -1;
+    if (buffer->size + length + 1 <= buffer->capacity) return 0;
+    capacity = buffer->capacity ? buffer->capacity * 2 : 128;
+    while (capacity < buffer->size + length + 1)
+        capacity *= 2;
+    if (buffer->data == buffer->storage)
+        {
+            data = malloc (capacity);
+            if (data && buffer->size) memcpy (data, buffer->data, buffer->size);
+        }
+    else
+        data = realloc (buffer->data, capacity);
+    if (!data)
+        {
+            buffer->isFailed = 1;
+            return -1;
+        }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+void
+OTUrlAppend (struct OTUrlBuffer *const buffer, const char *const string)
+{
+    size_t length = strlen (string);
+    if (OTUrlReserve (buffer, length) != 0) return;
+    memcpy (buffer->data + buffer->size, string, length + 1);
+    buffer->size += length;
+}
+
+/* Append a string percent-encoded. Spaces are encoded as '+'. */
+void
+OTUrlAppendEncoded (struct OTUrlBuffer *const buffer, const char *string)
 {
-    char *pstr = str, *buf = malloc (strlen (str) * 3 + 1), *pbuf = buf;
+    const unsigned char *c = (const unsigned char *)string;
+    char *out = NULL;
+    if (OTUrlReserve (buffer, strlen (string) * 3) != 0) return;
+    out = buffer->data + buffer->size;
+    for (; *c; c++)
+        {
+            if (OTUrlUnreserved[*c])
+                *out++ = *c;
+            else if (*c == ' ')
+                *out++ = '+';
+            else
+                {
+                    *out++ = '%';
+                    *out++ = OTUrlHex[*c >> 4];
+                    *out++ = OTUrlHex[*c & 15];
+                }
+        }
+    *out = '\0';
+    buffer->size = out - buffer->data;
+}
 
-    if (!buf)
-        return NULL;
-    while (*pstr)
+void
+OTUrlAppendInteger (struct OTUrlBuffer *const buffer, const long long value)
+{
+    char digits[24];
+    char *c = digits + sizeof (digits) - 1;
+    unsigned long long magnitude = value < 0 ? -(unsigned long long)value : value;
+    *c = '\0';
+    do
         {
-            if (isalnum (*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' || *pstr == '~')
-                *pbuf++ = *pstr;
-            else if (*pstr == ' ')
-                *pbuf++ = '+';
+            *--c = '0' + magnitude % 10;
+            magnitude /= 10;
+        }
+    while (magnitude);
+    if (value < 0) *--c = '-';
+    OTUrlAppend (buffer, c);
+}
+
+/* Append a template with the placeholders %s for a string and %d for an int. %% appends
+ * '%'. Strings are appended as they are. Any other placeholder fails the buffer. This is
+ * not printf, the arguments are not checked by the compiler. */
+void
+OTUrlExpand (struct OTUrlBuffer *const buffer, const char *format, ...)
+{
+    va_list argp;
+    const char *literal = format;
+    size_t length;
+    va_start (argp, format);
+    for (;;)
+        {
+            if (*format && *format != '%')
+                {
+                    format++;
+                    continue;
+                }
+            /* Flush the literal run before the conversion. */
+            length = format - literal;
+            if (length && OTUrlReserve (buffer, length) == 0)
+                {
+                    memcpy (buffer->data + buffer->size, literal, length);
+                    buffer->size += length;
+                    buffer->data[buffer->size] = '\0';
+                }
+            if (!*format) break;
+            format++;
+            if (*format == 's')
+                {
+                    const char *string = va_arg (argp, const char *);
+                    OTUrlAppend (buffer, string ? string : "(null)");
+                }
+            else if (*format == 'd')
+                OTUrlAppendInteger (buffer, va_arg (argp, int));
+            else if (*format == '%')
+                OTUrlAppend (buffer, "%");
             else
-                *pbuf++ = '%', *pbuf++ = to_hex (*pstr >> 4), *pbuf++ = to_hex (*pstr & 15);
-            pstr++;
+                buffer->isFailed = 1;
+            if (*format) format++;
+            literal = format;
         }
-    *pbuf = '\0';
-    return buf;
+    va_end (argp);
 }
 
+/* The string or NULL if an allocation failed. */
+char *
+OTUrlString (struct OTUrlBuffer *const buffer)
+{
+    if (buffer->isFailed || !buffer->data) return NULL;
+    return buffer->data;
+}
+
+/* Returns a url-encoded version of str */
+char *
+OTUrlEncode (char *str)
+{
+    struct OTUrlBuffer buffer;
+    OTUrlInit (&buffer, NULL, 0);
+    OTUrlAppendEncoded (&buffer, str);
+    if (!OTUrlString (&buffer))
+        {
+            OTUrlFree (&buffer);
+            return NULL;
+        }
+    return buffer.data;
+}
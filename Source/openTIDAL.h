@@ -45,7 +45,13 @@ extern "C"
         SERVER_ERROR,
         MALLOC_ERROR,
         UNKNOWN_MANIFEST_MIMETYPE,
-        UNKNOWN
+        UNKNOWN,
+        REQUEST_PENDING,
+        SERVICE_UNAVAILABLE,
+        STALE_OFFLINE,
+        CANCELLED,
+        DEADLINE_EXCEEDED,
+        NOT_SUPPORTED
     };
 
     enum OTQuality
@@ -60,6 +66,15 @@ extern "C"
         VIDEO_HIGH
     };
 
+    /* Response headers captured for the requests of a http-handle. Combine them with |. */
+    enum OTHeaders
+    {
+        HEADER_ENTITY_TAG = 1,
+        HEADER_CONTENT_LENGTH = 2,
+        HEADER_RETRY_AFTER = 4,
+        HEADER_CACHE_CONTROL = 8
+    };
+
     enum OTTypes
     {
         SESSION_CONTAINER,
@@ -91,6 +106,68 @@ extern "C"
         struct OTJsonContainer *tree;
         struct OTJsonContainer *renewalTree;
         void *mainHttpHandle;
+        /* Connection, DNS and TLS-session cache shared by all http-handles. */
+        void *httpShare;
+        /* TLS sessions stored next to the persistent config. */
+        void *httpTickets;
+        /* Published access-token snapshot with its authorisation header list. */
+        void *httpHeaders;
+        /* Background token refresher started with OTSessionBackgroundRefresh. */
+        void *refresher;
+        /* Request counters and learned response sizes. */
+        void *httpMetrics;
+        /* HTTP/2 multiplexing. 0 = disabled, otherwise the maximum number of
+         * concurrent streams per connection. */
+        int multiplexStreams;
+        /* Retry policy: maximum number of retries of a request and the time in
+         * milliseconds after which no retry is started. */
+        int retryLimit;
+        long retryDeadline;
+        /* Serve expired cached responses if the transport fails. */
+        int offlineFallback;
+        /* Per-host circuit breaker. */
+        void *httpBreaker;
+        /* Per-host rate limit set with OTSessionRateLimit. */
+        void *httpLimiter;
+        /* Identical GET requests in flight. */
+        void *httpFlights;
+        /* Entity-tags of the playlists mutated with the session. */
+        void *playlistTags;
+        /* Metadata response cache attached with OTSessionCache. Not owned by the session. */
+        void *cache;
+        /* Persistent response cache attached with OTSessionDiskCache. Not owned by the session. */
+        void *diskCache;
+        /* Negative cache attached with OTSessionNegativeCache. Not owned by the session. */
+        void *negativeCache;
+    };
+
+    /* Counters of all requests performed with a session. */
+    struct OTStatisticsContainer
+    {
+        unsigned long responses;
+        /* Decoded response bodies and the bodies as received. The difference is the
+         * saving of the negotiated content encoding. */
+        unsigned long responseBytes;
+        unsigned long wireBytes;
+        /* Reallocations of response buffers. Close to one per response if the
+         * Content-Length or the learned response size is accurate. */
+        unsigned long reallocations;
+        /* Requests answered by the negative cache and missing artefacts stored in it. */
+        unsigned long avoidedRequests;
+        unsigned long negativeEntries;
+        /* Requests delayed by the rate limit and their total wait in milliseconds. */
+        unsigned long throttledRequests;
+        unsigned long throttleWait;
+    };
+
+    /* Captured response headers. NULL or -1 if the header was not requested or not sent. */
+    struct OTHeaderContainer
+    {
+        char *entityTag;
+        char *cacheControl;
+        long long contentLength;
+        /* Seconds. A HTTP-date is converted to the seconds from now. */
+        long retryAfter;
     };
 
     struct OTContentContainer
@@ -99,6 +176,11 @@ extern "C"
          * parsing of API specific error codes. */
         enum OTStatus status;
         struct OTJsonContainer *tree;
+        /* Size of the decoded response body and of the body as received. */
+        unsigned long responseBytes;
+        unsigned long wireBytes;
+        /* Headers requested with OTHttpThreadHandleHeaders. */
+        struct OTHeaderContainer headers;
     };
 
     struct OTContentStreamContainer
@@ -106,6 +188,9 @@ extern "C"
         enum OTStatus status;
         struct OTJsonContainer *tree;
         struct OTJsonContainer *manifest;
+        unsigned long responseBytes;
+        unsigned long wireBytes;
+        struct OTHeaderContainer headers;
     };
 
     /* Manage an OTSession handle. */
@@ -115,9 +200,26 @@ extern "C"
     int OTSessionLogin (struct OTSessionContainer *const session, const char *const location);
     /* disabled = 0, enabled = 1, debug = 2 */
     void OTSessionVerbose (struct OTSessionContainer *const session, const int enabled);
+    /* HTTP/2 multiplexing: disabled = 0, otherwise the maximum number of concurrent streams */
+    void OTSessionMultiplex (struct OTSessionContainer *const session, const int maxStreams);
+    /* Retries of failed requests (default 3 retries within 15000 milliseconds), 0 = disabled */
+    void OTSessionRetry (struct OTSessionContainer *const session, const int retryLimit,
+                         const long deadline);
+    /* Rate limit of the baseUrl (isAuthHost = 0) or authUrl host, 0 requests = disabled */
+    void OTSessionRateLimit (struct OTSessionContainer *const session, const int isAuthHost,
+                             const long requests, const long interval, const long burst);
+    /* Offline fallback: disabled = 0, enabled = 1 */
+    void OTSessionOffline (struct OTSessionContainer *const session, const int enabled);
     void OTSessionChangeQuality (struct OTSessionContainer *const session, enum OTQuality quality);
     int OTSessionWriteChanges (const struct OTSessionContainer *session);
     enum OTStatus OTSessionRefresh (struct OTSessionContainer *session);
+    /* Pre-connect to baseUrl and authUrl, optionally on a background thread */
+    int OTSessionWarmup (struct OTSessionContainer *const session, const int connections,
+                         const int isBackground);
+    /* Background token refresh: disabled = 0, enabled = 1 */
+    int OTSessionBackgroundRefresh (struct OTSessionContainer *const session, const int enabled);
+    void OTSessionStatistics (const struct OTSessionContainer *const session,
+                              struct OTStatisticsContainer *const statistics);
     void OTSessionCleanup (struct OTSessionContainer *session);
 
     int OTPersistentCreate (const struct OTSessionContainer *const session,
@@ -128,10 +230,82 @@ extern "C"
      * Keep the handle(s) alive to utilise persistent connections.
      * DO NOT use one handle in multiple threads!
      * Cleanup the handles before exiting to avoid a memory leak.
-     * These handles DO NOT refresh a TIDAL session. Only the
-     * main handle refreshes it. */
+     * A request of any handle that finds the access token expired
+     * renews it. Concurrent renewals are coalesced into one token
+     * request, the other requests wait for its result.
+     * A handle shares the connection, DNS and TLS-session cache
+     * of the session it is first used with. Cleanup the handles
+     * before the session.
+     * If multiplexing is enabled with OTSessionMultiplex, handles
+     * negotiate HTTP/2 and wait for a connection that can be
+     * multiplexed instead of opening a new one. */
     void *OTHttpThreadHandleCreate (void);
     void OTHttpThreadHandleCleanup (void *handle);
+    /* Capture response headers (enum OTHeaders) for the requests of a handle. They are
+     * returned in the headers of the content containers. 0 captures none. */
+    void OTHttpThreadHandleHeaders (void *threadHandle, const unsigned int headers);
+
+    /* Deadlines and cancellation.
+     * The deadline and the cancellation token of a handle (thread, main or asynchronous
+     * request handle) apply to every request performed with it, including its retries.
+     * A request past the deadline returns DEADLINE_EXCEEDED, a cancelled one CANCELLED.
+     * A token can be attached to many handles and cancelled from any thread. Detach it
+     * from the handles before its cleanup. */
+    void OTHttpThreadHandleDeadline (void *threadHandle, const long milliseconds);
+    void OTHttpThreadHandleCancel (void *threadHandle, void *cancel);
+    void *OTCancelCreate (void);
+    void OTCancelTrigger (void *cancel);
+    void OTCancelCleanup (void *cancel);
+
+    /* Asynchronous request engine (libcurl multi interface).
+     * Drive many concurrent requests from a single thread. Reserve a request handle
+     * with OTAsyncRequestCreate and pass it as threadHandle to one service function.
+     * The service function returns immediately (NULL or REQUEST_PENDING). The result
+     * is delivered to the callback in OTAsyncPerform, or if the callback is NULL,
+     * returned by OTAsyncRead. Containers must be deallocated with OTDeallocContainer.
+     * The engine and its request handles must only be used by one thread.
+     * Requests use the caches of the session, a cache hit is delivered by the next
+     * OTAsyncPerform. Unlike requests of other handles they do not wait for an identical
+     * request in flight.
+     * With OTSessionMultiplex concurrent requests share one HTTP/2 connection per host. */
+    typedef void (*OTAsyncCallback) (void *container, enum OTTypes type, enum OTStatus status,
+                                     void *userData);
+    void *OTAsyncInit (void);
+    void *OTAsyncRequestCreate (void *async, OTAsyncCallback callback, void *userData);
+    int OTAsyncPerform (void *async, const int timeoutMs);
+    int OTAsyncRead (void *async, void **container, enum OTTypes *type, enum OTStatus *status,
+                     void **userData);
+    void OTAsyncCleanup (void *async);
+
+    /* Metadata response cache.
+     * Public catalog responses (OTServiceGetStandard and the album, artist and mix pages
+     * of OTServiceGetPage) are cached per countryCode with a memory budget in bytes.
+     * A cache can be shared by many sessions and threads. Cleanup the sessions first. */
+    void *OTCacheCreate (const size_t budget);
+    void OTSessionCache (struct OTSessionContainer *const session, void *cache);
+    void OTCacheCleanup (void *cache);
+    /* Soft and hard time to live in seconds of an endpoint family: albums, artists, tracks,
+     * videos, mixes, playlists or pages. Between both an entry is returned at once and
+     * refreshed in the background. Configure the cache before it is attached. */
+    int OTCacheLifetime (void *cache, const char *const family, const long softTTL,
+                         const long hardTTL);
+
+    /* Persistent response cache.
+     * Stores the bodies of cacheable responses in a segment file of the directory, indexed
+     * by a memory-mapped hash table. A restarted process starts with a warm cache.
+     * The capacity limits the segment file in bytes, the oldest records are evicted to stay
+     * within it. Close the cache after the sessions. */
+    void *OTDiskCacheOpen (const char *const directory, const size_t capacity);
+    void OTSessionDiskCache (struct OTSessionContainer *const session, void *diskCache);
+    void OTDiskCacheClose (void *diskCache);
+
+    /* Negative cache.
+     * Remembers artefacts of OTServiceGetStandard and OTServiceGetStream that were not
+     * found (404) in the countryCode of the session for ttl seconds. A cache holds at least
+     * the number of entries and can be shared by many sessions. Cleanup the sessions first. */
+    void *OTNegativeCacheCreate (const size_t entries, const long ttl);
+    void OTSessionNegativeCache (struct OTSessionContainer *const session, void *negativeCache);
+    void OTNegativeCacheCleanup (void *negativeCache);
 
     /* SECTION: Service functions. */
     /* OAuth2 service.*/